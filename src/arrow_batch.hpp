@@ -0,0 +1,298 @@
+#ifndef OSM_GIS_EXPORT_ARROW_BATCH_HPP
+#define OSM_GIS_EXPORT_ARROW_BATCH_HPP
+
+#include <gdalcpp.hpp>
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if GDAL_VERSION_NUM >= GDAL_COMPUTE_VERSION(3, 8, 0)
+# define HAVE_ARROW_BATCHES 1
+#endif
+
+#ifdef HAVE_ARROW_BATCHES
+
+/**
+ * Collects features for one layer column by column and hands them to
+ * OGR as Arrow record batches (OGRLayer::WriteArrowBatch) instead of
+ * creating one OGRFeature per object.
+ *
+ * Columns are declared once with add_column(), then each row is filled
+ * in column order with append() and finished with commit_row(). The
+ * geometry is always the last column and stored as WKB.
+ *
+ * Variable length columns use the large Arrow formats with 64 bit
+ * offsets, the strings or WKB of one batch can be larger than 2 GBytes.
+ */
+class ArrowBatch {
+
+    struct column {
+        std::string name;
+        const char* format;
+        std::vector<char> values;
+        std::vector<int64_t> offsets;
+        std::vector<uint8_t> validity; // only filled if there are nulls
+        std::size_t null_count = 0;
+    };
+
+    GDALDataset& m_dataset;
+    gdalcpp::Layer& m_layer;
+    std::size_t m_max_length;
+    std::size_t m_length = 0;
+    std::size_t m_current_column = 0;
+
+    std::vector<column> m_columns;
+    std::string m_geometry_metadata;
+
+    // Storage for the Arrow C structures passed to GDAL. They only
+    // reference the column data, nothing is copied.
+    std::vector<ArrowSchema> m_child_schemas;
+    std::vector<ArrowSchema*> m_child_schema_ptrs;
+    std::vector<ArrowArray> m_child_arrays;
+    std::vector<ArrowArray*> m_child_array_ptrs;
+    std::vector<const void*> m_child_buffers;
+
+    static void release_schema(ArrowSchema* schema) {
+        for (int64_t i = 0; i < schema->n_children; ++i) {
+            ArrowSchema* child = schema->children[i];
+            if (child->release) {
+                child->release(child);
+            }
+        }
+        schema->release = nullptr;
+    }
+
+    static void release_child_schema(ArrowSchema* schema) {
+        schema->release = nullptr;
+    }
+
+    static void release_array(ArrowArray* array) {
+        for (int64_t i = 0; i < array->n_children; ++i) {
+            ArrowArray* child = array->children[i];
+            if (child->release) {
+                child->release(child);
+            }
+        }
+        array->release = nullptr;
+    }
+
+    static void release_child_array(ArrowArray* array) {
+        array->release = nullptr;
+    }
+
+    static bool is_variable_length(const column& col) noexcept {
+        return col.format[0] == 'U' || col.format[0] == 'Z';
+    }
+
+    column& next_column() {
+        assert(m_current_column < m_columns.size());
+        return m_columns[m_current_column++];
+    }
+
+    template <typename T>
+    void append_value(T value) {
+        auto& col = next_column();
+        const auto size = col.values.size();
+        col.values.resize(size + sizeof(T));
+        std::memcpy(col.values.data() + size, &value, sizeof(T));
+    }
+
+    void append_bytes(const char* data, std::size_t length) {
+        auto& col = next_column();
+        col.values.insert(col.values.end(), data, data + length);
+        col.offsets.push_back(static_cast<int64_t>(col.values.size()));
+    }
+
+    // Mark the value of the current row in the column as null. The
+    // bitmap is only created when the first null shows up.
+    void mark_null(column& col) {
+        if (col.null_count == 0) {
+            col.validity.assign((m_max_length + 7) / 8, 0xffU);
+        }
+        col.validity[m_length / 8] &= static_cast<uint8_t>(~(1U << (m_length % 8)));
+        ++col.null_count;
+    }
+
+public:
+
+    ArrowBatch(gdalcpp::Dataset& dataset, gdalcpp::Layer& layer, std::size_t max_length) :
+        m_dataset(dataset.get()),
+        m_layer(layer),
+        m_max_length(max_length) {
+
+        // Arrow metadata is encoded as number of pairs followed by
+        // length-prefixed keys and values.
+        const auto add_int32 = [this](int32_t value) {
+            m_geometry_metadata.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        };
+        const std::string key{"ARROW:extension:name"};
+        const std::string value{"ogc.wkb"};
+        add_int32(1);
+        add_int32(static_cast<int32_t>(key.size()));
+        m_geometry_metadata += key;
+        add_int32(static_cast<int32_t>(value.size()));
+        m_geometry_metadata += value;
+    }
+
+    /**
+     * Add a column with the given name and Arrow format string ("i",
+     * "g", "U", "tss:UTC" are used here). It must match a field on the
+     * layer.
+     */
+    void add_column(const char* name, const char* format) {
+        m_columns.push_back(column{name, format, {}, {0}, {}, 0});
+    }
+
+    /// Add the WKB geometry column. Must be called after all other columns.
+    void add_geometry_column() {
+        const char* name = m_layer.get().GetGeometryColumn();
+        m_columns.push_back(column{(name && *name) ? name : "geometry", "Z", {}, {0}, {}, 0});
+    }
+
+    void append(int32_t value) {
+        append_value(value);
+    }
+
+    void append(int64_t value) {
+        append_value(value);
+    }
+
+    void append(double value) {
+        append_value(value);
+    }
+
+    void append(const char* value) {
+        append_bytes(value, std::strlen(value));
+    }
+
+    void append(const std::string& value) {
+        append_bytes(value.data(), value.size());
+    }
+
+    /// Append null to a fixed size column with values of type T.
+    template <typename T>
+    void append_null() {
+        assert(m_current_column < m_columns.size());
+        mark_null(m_columns[m_current_column]);
+        append_value(T{});
+    }
+
+    void append_geometry(const OGRGeometry& geometry) {
+        auto& col = m_columns[m_current_column];
+        const auto size = col.values.size();
+        col.values.resize(size + static_cast<std::size_t>(geometry.WkbSize()));
+        geometry.exportToWkb(wkbNDR, reinterpret_cast<unsigned char*>(col.values.data() + size));
+        col.offsets.push_back(static_cast<int64_t>(col.values.size()));
+        ++m_current_column;
+    }
+
+    void commit_row() {
+        assert(m_current_column == m_columns.size());
+        m_current_column = 0;
+        if (++m_length == m_max_length) {
+            flush();
+        }
+    }
+
+    void flush() {
+        if (m_length == 0) {
+            return;
+        }
+
+        const auto num_columns = m_columns.size();
+
+        m_child_schemas.assign(num_columns, ArrowSchema{});
+        m_child_schema_ptrs.clear();
+        m_child_arrays.assign(num_columns, ArrowArray{});
+        m_child_array_ptrs.clear();
+        m_child_buffers.assign(num_columns * 3, nullptr);
+
+        for (std::size_t i = 0; i < num_columns; ++i) {
+            const auto& col = m_columns[i];
+
+            auto& schema = m_child_schemas[i];
+            schema.format = col.format;
+            schema.name = col.name.c_str();
+            schema.flags = ARROW_FLAG_NULLABLE;
+            schema.release = release_child_schema;
+            if (i == num_columns - 1) {
+                schema.metadata = m_geometry_metadata.data();
+            }
+            m_child_schema_ptrs.push_back(&schema);
+
+            const void** buffers = &m_child_buffers[i * 3];
+            auto& array = m_child_arrays[i];
+            array.length = static_cast<int64_t>(m_length);
+            array.null_count = static_cast<int64_t>(col.null_count);
+            array.buffers = buffers;
+            if (col.null_count > 0) {
+                buffers[0] = col.validity.data();
+            }
+            array.release = release_child_array;
+            if (is_variable_length(col)) {
+                array.n_buffers = 3;
+                buffers[1] = col.offsets.data();
+                buffers[2] = col.values.data();
+            } else {
+                array.n_buffers = 2;
+                buffers[1] = col.values.data();
+            }
+            m_child_array_ptrs.push_back(&array);
+        }
+
+        ArrowSchema schema{};
+        schema.format = "+s";
+        schema.name = "";
+        schema.n_children = static_cast<int64_t>(num_columns);
+        schema.children = m_child_schema_ptrs.data();
+        schema.release = release_schema;
+
+        const void* struct_buffers[1] = {nullptr};
+        ArrowArray array{};
+        array.length = static_cast<int64_t>(m_length);
+        array.null_count = 0;
+        array.n_buffers = 1;
+        array.buffers = struct_buffers;
+        array.n_children = static_cast<int64_t>(num_columns);
+        array.children = m_child_array_ptrs.data();
+        array.release = release_array;
+
+        const std::string geometry_name{"GEOMETRY_NAME=" + m_columns.back().name};
+        const char* const options[] = {geometry_name.c_str(), nullptr};
+
+        // Not all drivers support transactions, those simply write
+        // the batch directly.
+        const bool transaction = m_dataset.StartTransaction() == OGRERR_NONE;
+        bool ok = m_layer.get().WriteArrowBatch(&schema, &array, options);
+        if (transaction) {
+            ok = (m_dataset.CommitTransaction() == OGRERR_NONE) && ok;
+        }
+
+        if (array.release) {
+            array.release(&array);
+        }
+        schema.release(&schema);
+
+        if (!ok) {
+            throw std::runtime_error{std::string{"Writing Arrow batch to layer '"} + m_layer.name() + "' failed"};
+        }
+
+        for (auto& col : m_columns) {
+            col.values.clear();
+            col.offsets.resize(1);
+            col.validity.clear();
+            col.null_count = 0;
+        }
+        m_length = 0;
+    }
+
+}; // class ArrowBatch
+
+#endif
+
+#endif // OSM_GIS_EXPORT_ARROW_BATCH_HPP
@@ -0,0 +1,78 @@
+#ifndef OSM_GIS_EXPORT_GEOMETRY_RECYCLER_HPP
+#define OSM_GIS_EXPORT_GEOMETRY_RECYCLER_HPP
+
+#include <gdalcpp.hpp>
+
+#include <memory>
+#include <vector>
+
+/**
+ * Keeps the parts of multipolygons and multilinestrings when they are
+ * cleared, so that a geometry object reused for all features of a layer
+ * can be filled again without allocating new polygons, rings, or
+ * linestrings for every feature.
+ */
+class GeometryRecycler {
+
+    std::vector<std::unique_ptr<OGRPolygon>> m_polygons;
+    std::vector<std::unique_ptr<OGRLinearRing>> m_rings;
+    std::vector<std::unique_ptr<OGRLineString>> m_linestrings;
+
+    template <typename T>
+    static std::unique_ptr<T> take(std::vector<std::unique_ptr<T>>& pool) {
+        if (pool.empty()) {
+            return std::make_unique<T>();
+        }
+        auto geometry = std::move(pool.back());
+        pool.pop_back();
+        return geometry;
+    }
+
+public:
+
+    void clear(OGRMultiPolygon& multipolygon) {
+        for (int i = multipolygon.getNumGeometries() - 1; i >= 0; --i) {
+            auto* polygon = static_cast<OGRPolygon*>(multipolygon.getGeometryRef(i));
+            multipolygon.removeGeometry(i, FALSE);
+            for (int j = polygon->getNumInteriorRings() - 1; j >= 0; --j) {
+                m_rings.emplace_back(polygon->stealInteriorRing(j));
+            }
+            if (auto* ring = polygon->stealExteriorRing()) {
+                m_rings.emplace_back(ring);
+            }
+            polygon->empty(); // only drops the now empty ring slots
+            m_polygons.emplace_back(polygon);
+        }
+    }
+
+    void clear(OGRMultiLineString& multilinestring) {
+        for (int i = multilinestring.getNumGeometries() - 1; i >= 0; --i) {
+            auto* linestring = static_cast<OGRLineString*>(multilinestring.getGeometryRef(i));
+            multilinestring.removeGeometry(i, FALSE);
+            m_linestrings.emplace_back(linestring);
+        }
+    }
+
+    /// Add polygon without rings to the multipolygon.
+    OGRPolygon& add_polygon(OGRMultiPolygon& multipolygon) {
+        auto polygon = take(m_polygons);
+        OGRPolygon& result = *polygon;
+        multipolygon.addGeometryDirectly(polygon.release());
+        return result;
+    }
+
+    void add_ring(OGRPolygon& polygon, const std::vector<OGRRawPoint>& points) {
+        auto ring = take(m_rings);
+        ring->setPoints(static_cast<int>(points.size()), points.data());
+        polygon.addRingDirectly(ring.release());
+    }
+
+    void add_linestring(OGRMultiLineString& multilinestring, const std::vector<OGRRawPoint>& points) {
+        auto linestring = take(m_linestrings);
+        linestring->setPoints(static_cast<int>(points.size()), points.data());
+        multilinestring.addGeometryDirectly(linestring.release());
+    }
+
+}; // class GeometryRecycler
+
+#endif // OSM_GIS_EXPORT_GEOMETRY_RECYCLER_HPP
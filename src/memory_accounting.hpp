@@ -0,0 +1,223 @@
+#ifndef OSM_GIS_EXPORT_MEMORY_ACCOUNTING_HPP
+#define OSM_GIS_EXPORT_MEMORY_ACCOUNTING_HPP
+
+#include <osmium/handler.hpp>
+#include <osmium/osm/object.hpp>
+#include <osmium/util/memory.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Keeps track of the memory used by the main data structures. Each
+ * structure is registered as a source, a function returning its size in
+ * bytes. Samples of all sources and the process memory are taken at the
+ * start and end of each phase and about every `interval` in between. If
+ * a file name is given, all samples are written to it as tab-separated
+ * time series (sizes in MBytes). The maximum of each source per phase is
+ * printed with print_summary().
+ *
+ * The sources are only ever called from the thread using this object,
+ * never concurrently with changes to the data structures: A timer thread
+ * only marks a sample as due, it is taken by the handler returned from
+ * handler() with the next object it sees. Add that handler to the
+ * osmium::apply() or osmium::relations::read_relations() calls.
+ *
+ * If the object is not enabled, all functions do nothing.
+ */
+class MemoryAccounting {
+
+    using clock = std::chrono::steady_clock;
+
+    struct phase {
+        std::string name;
+        std::vector<double> max_mbytes;
+    };
+
+    std::vector<std::pair<std::string, std::function<std::size_t()>>> m_sources;
+    std::vector<phase> m_phases;
+    std::ofstream m_out;
+    clock::time_point m_start = clock::now();
+    std::chrono::milliseconds m_interval;
+    bool m_enabled;
+
+    std::atomic<bool> m_sample_due{false};
+
+    // Only used to stop the timer thread.
+    std::mutex m_mutex;
+    std::condition_variable m_stop_signal;
+    bool m_stop = false;
+    std::thread m_thread;
+
+    static double mbytes(std::size_t bytes) noexcept {
+        return static_cast<double>(bytes) / (1024.0 * 1024.0);
+    }
+
+    void sample() {
+        const auto now = clock::now();
+
+        auto& max = m_phases.back().max_mbytes;
+        const osmium::MemoryUsage memory;
+        max[0] = std::max(max[0], static_cast<double>(memory.current()));
+
+        if (m_out.is_open()) {
+            m_out << std::chrono::duration<double>(now - m_start).count()
+                  << '\t' << m_phases.back().name
+                  << '\t' << static_cast<double>(memory.current());
+        }
+        for (std::size_t i = 0; i < m_sources.size(); ++i) {
+            const double size = mbytes(m_sources[i].second());
+            max[i + 1] = std::max(max[i + 1], size);
+            if (m_out.is_open()) {
+                m_out << '\t' << size;
+            }
+        }
+        if (m_out.is_open()) {
+            m_out << '\n';
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock{m_mutex};
+        while (!m_stop_signal.wait_for(lock, m_interval, [this]() { return m_stop; })) {
+            m_sample_due = true;
+        }
+    }
+
+    void stop() {
+        {
+            const std::lock_guard<std::mutex> lock{m_mutex};
+            m_stop = true;
+        }
+        m_stop_signal.notify_all();
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+    }
+
+public:
+
+    MemoryAccounting(bool enabled, const std::string& filename, std::chrono::milliseconds interval) :
+        m_interval(interval),
+        m_enabled(enabled) {
+        if (m_enabled && !filename.empty()) {
+            m_out.open(filename);
+            if (!m_out) {
+                throw std::runtime_error{"Can not open memory log file '" + filename + "'"};
+            }
+            m_out << std::fixed << std::setprecision(1);
+        }
+    }
+
+    MemoryAccounting(const MemoryAccounting&) = delete;
+    MemoryAccounting& operator=(const MemoryAccounting&) = delete;
+
+    MemoryAccounting(MemoryAccounting&&) = delete;
+    MemoryAccounting& operator=(MemoryAccounting&&) = delete;
+
+    ~MemoryAccounting() noexcept {
+        stop();
+    }
+
+    /// Register source. All sources must be added before the first phase starts.
+    void add_source(std::string name, std::function<std::size_t()> func) {
+        m_sources.emplace_back(std::move(name), std::move(func));
+    }
+
+    /// End the current phase, if any, and start the next one.
+    void start_phase(std::string name) {
+        if (!m_enabled) {
+            return;
+        }
+        if (!m_phases.empty()) {
+            sample(); // end of previous phase
+        } else if (m_out.is_open()) {
+            m_out << "seconds\tphase\tprocess_MB";
+            for (const auto& source : m_sources) {
+                m_out << '\t' << source.first << "_MB";
+            }
+            m_out << '\n';
+        }
+        m_phases.push_back(phase{std::move(name), std::vector<double>(m_sources.size() + 1, 0.0)});
+        sample();
+
+        if (!m_thread.joinable()) {
+            m_thread = std::thread{[this]() {
+                run();
+            }};
+        }
+    }
+
+    /// Take a sample if the timer says one is due.
+    void sample_if_due() {
+        if (m_sample_due.load(std::memory_order_relaxed) && !m_phases.empty()) {
+            m_sample_due = false;
+            sample();
+        }
+    }
+
+    class SamplingHandler : public osmium::handler::Handler {
+
+        MemoryAccounting& m_accounting;
+
+    public:
+
+        explicit SamplingHandler(MemoryAccounting& accounting) noexcept :
+            m_accounting(accounting) {
+        }
+
+        void osm_object(const osmium::OSMObject& /*object*/) {
+            m_accounting.sample_if_due();
+        }
+
+        void flush() {
+            m_accounting.sample_if_due();
+        }
+
+        // Only there so that the handler can be used as a manager in
+        // osmium::relations::read_relations().
+        void prepare_for_lookup() const noexcept {
+        }
+
+    }; // class SamplingHandler
+
+    /// The handler taking the samples that are due.
+    SamplingHandler handler() noexcept {
+        return SamplingHandler{*this};
+    }
+
+    /// Stop sampling, take final sample and print peak memory of all sources per phase.
+    void print_summary(std::ostream& out) {
+        stop();
+        if (m_phases.empty()) {
+            return;
+        }
+        sample();
+        m_out.flush();
+
+        out << "Peak memory use per phase (MBytes):\n";
+        for (const auto& p : m_phases) {
+            out << "  " << p.name << ": process=" << p.max_mbytes[0];
+            for (std::size_t i = 0; i < m_sources.size(); ++i) {
+                out << ' ' << m_sources[i].first << '=' << p.max_mbytes[i + 1];
+            }
+            out << '\n';
+        }
+    }
+
+}; // class MemoryAccounting
+
+#endif // OSM_GIS_EXPORT_MEMORY_ACCOUNTING_HPP
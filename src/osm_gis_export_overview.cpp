@@ -1,21 +1,29 @@
-
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
-#include <cstdlib>
 #include <exception>
 #include <getopt.h>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include "memory_accounting.hpp"
+#include "overview_handler.hpp"
+#include "route_manager.hpp"
+#include "simple_ring.hpp"
+#include "tiled_output.hpp"
 
 #include <gdalcpp.hpp>
 
 #include <osmium/area/assembler.hpp>
 #include <osmium/area/multipolygon_manager.hpp>
-#include <osmium/geom/factory.hpp>
 #include <osmium/geom/ogr.hpp>
-#include <osmium/handler.hpp>
 #include <osmium/handler/node_locations_for_ways.hpp>
 #include <osmium/index/map/flex_mem.hpp> // IWYU pragma: keep
 #include <osmium/io/any_input.hpp> // IWYU pragma: keep
+#include <osmium/memory/buffer.hpp>
 #include <osmium/util/memory.hpp>
 #include <osmium/util/verbose_output.hpp>
 #include <osmium/visitor.hpp>
@@ -23,123 +31,11 @@
 using index_type = osmium::index::map::FlexMem<osmium::unsigned_object_id_type, osmium::Location>;
 using location_handler_type = osmium::handler::NodeLocationsForWays<index_type>;
 
-struct config {
-    bool add_untagged_nodes = false;
-    bool add_metadata = false;
-    bool verbose = false;
-};
-
-template <class TProjection>
-class MyOGRHandler : public osmium::handler::Handler {
-
-    static const std::size_t max_length_tags = 200;
-
-    config m_cfg;
-
-    gdalcpp::Dataset& m_dataset;
-    gdalcpp::Layer m_layer_point;
-    gdalcpp::Layer m_layer_linestring;
-    gdalcpp::Layer m_layer_multipolygon;
-
-    osmium::geom::OGRFactory<TProjection>& m_factory;
-
-    void add_metadata_fields(gdalcpp::Layer& layer) {
-        layer.add_field("version", OFTInteger, 7);
-        layer.add_field("changeset", OFTInteger, 7);
-        layer.add_field("timestamp", OFTString, 20);
-        layer.add_field("uid", OFTInteger, 7);
-        layer.add_field("user", OFTString, 256);
-    }
-
-    static void add_metadata(gdalcpp::Feature& feature, const osmium::OSMObject& object) {
-        feature.set_field("version", int32_t(object.version()));
-        feature.set_field("changeset", int32_t(object.changeset()));
-        feature.set_field("timestamp", object.timestamp().to_iso().c_str());
-        feature.set_field("uid", int32_t(object.uid()));
-        feature.set_field("user", object.user());
-    }
-
-    static void add_tags(gdalcpp::Feature& feature, const osmium::OSMObject& object) {
-        std::string tags;
-        for (const auto& tag : object.tags()) {
-            tags += tag.key();
-            tags += "=";
-            tags += tag.value();
-            tags += ",";
-        }
-        if (!tags.empty()) {
-            tags.pop_back();
-        }
-        feature.set_field("tags", tags.c_str());
-    }
-
-    void add_feature(gdalcpp::Feature& feature, const osmium::OSMObject& object) {
-        if (m_cfg.add_metadata) {
-            add_metadata(feature, object);
-        }
-        add_tags(feature, object);
-        feature.add_to_layer();
-    }
-
-public:
-
-    MyOGRHandler(gdalcpp::Dataset& dataset, osmium::geom::OGRFactory<TProjection>& factory, const config& cfg) :
-        m_cfg(cfg),
-        m_dataset(dataset),
-        m_layer_point(dataset, "points", wkbPoint, {"SPATIAL_INDEX=NO"}),
-        m_layer_linestring(dataset, "lines", wkbLineString, {"SPATIAL_INDEX=NO"}),
-        m_layer_multipolygon(dataset, "areas", wkbMultiPolygon, {"SPATIAL_INDEX=NO"}),
-        m_factory(factory) {
-
-        m_layer_point.add_field("id", OFTReal, 10);
-        m_layer_linestring.add_field("id", OFTInteger, 7);
-        m_layer_multipolygon.add_field("id", OFTInteger, 7);
-
-        m_layer_point.add_field("tags", OFTString, max_length_tags);
-        m_layer_linestring.add_field("tags", OFTString, max_length_tags);
-        m_layer_multipolygon.add_field("tags", OFTString, max_length_tags);
-
-        if (m_cfg.add_metadata) {
-            add_metadata_fields(m_layer_point);
-            add_metadata_fields(m_layer_linestring);
-            add_metadata_fields(m_layer_multipolygon);
-        }
-    }
-
-    void node(const osmium::Node& node) {
-        if (m_cfg.add_untagged_nodes || !node.tags().empty()) {
-            gdalcpp::Feature feature{m_layer_point, m_factory.create_point(node)};
-            feature.set_field("id", double(node.id()));
-            add_feature(feature, node);
-        }
-    }
-
-    void way(const osmium::Way& way) {
-        try {
-            gdalcpp::Feature feature{m_layer_linestring, m_factory.create_linestring(way)};
-            feature.set_field("id", int32_t(way.id()));
-            add_feature(feature, way);
-        } catch (const osmium::geometry_error&) {
-            std::cerr << "Ignoring illegal geometry for way " << way.id() << ".\n";
-        }
-    }
-
-    void area(const osmium::Area& area) {
-        try {
-            gdalcpp::Feature feature{m_layer_multipolygon, m_factory.create_multipolygon(area)};
-            feature.set_field("id", int32_t(area.id()));
-            add_feature(feature, area);
-        } catch (const osmium::geometry_error&) {
-            std::cerr << "Ignoring illegal geometry for area "
-                        << area.id()
-                        << " created from "
-                        << (area.from_way() ? "way" : "relation")
-                        << " with id="
-                        << area.orig_id() << ".\n";
-        }
-    }
-
-};
+// Keys with few distinct values. Tags with these keys are written as
+// dictionary codes if --dictionary is given without a list of keys.
+const char* const default_dictionary_keys = "access,admin_level,amenity,barrier,boundary,building,"
+                                            "highway,landuse,leisure,man_made,natural,oneway,place,"
+                                            "power,railway,route,shop,surface,tourism,type,waterway";
 
 /* ================================================== */
 
@@ -149,21 +45,44 @@ void print_help() {
               << "OPTIONS:\n"
               << "  -h, --help                      Print usage information\n"
               << "  -v, --verbose                   Enable verbose output\n"
+              << "  --memory-log=FILE               Write memory use of main data structures\n"
+              << "                                      every second to FILE\n"
               << "  -o, --output=FILENAME           Output file name\n"
               << "  -f, --output-format=FORMAT      Output OGR format (Default: 'SQLite')\n"
               << "  --add-untagged-nodes            Add untagged nodes to point layer\n"
               << "  --add-metadata                  Add columns for version, changeset,\n"
               << "                                      timestamp, uid, and user\n"
+              << "  --add-routes                    Add layer with bus, hiking, and road\n"
+              << "                                      route relations\n"
               << "  --features-per-transaction=NUM  Number of features to add per\n"
-              << "                                      transaction (Default: 100000)\n";
+              << "                                      transaction (Default: 100000)\n"
+              << "  --dictionary[=KEYS]             Write tags with the comma-separated KEYS\n"
+              << "                                      (Default: some common keys with few\n"
+              << "                                      values) as codes of key=value pairs in\n"
+              << "                                      the tag_codes field with lookup tables\n"
+              << "                                      LAYER_tags\n"
+              << "  --tiles=ZOOM                    Write one dataset per tile of the given\n"
+              << "                                      zoom level into the output directory\n"
+              << "                                      (as ZOOM/X/Y.EXT)\n"
+              << "  --clip                          Clip features at the tile boundaries\n"
+              << "                                      (only with --tiles)\n"
+              << "  --arrow-batch-size=NUM          Write features in columnar batches of\n"
+              << "                                      NUM features through OGR's Arrow\n"
+              << "                                      interface (needs GDAL >= 3.8)\n";
 }
 
 int main(int argc, char* argv[]) {
-    static struct option long_options[] = {{"output-format", required_argument, nullptr, 'f'},
+    static struct option long_options[] = {{"arrow-batch-size", required_argument, nullptr, 'a'},
+                                           {"clip", no_argument, nullptr, 'c'},
+                                           {"dictionary", optional_argument, nullptr, 'D'},
+                                           {"output-format", required_argument, nullptr, 'f'},
                                            {"features-per-transaction", required_argument, nullptr, 'F'},
                                            {"help", no_argument, nullptr, 'h'},
                                            {"add-metadata", no_argument, nullptr, 'm'},
+                                           {"memory-log", required_argument, nullptr, 'M'},
+                                           {"add-routes", no_argument, nullptr, 'r'},
                                            {"output", required_argument, nullptr, 'o'},
+                                           {"tiles", required_argument, nullptr, 't'},
                                            {"add-untagged-nodes", no_argument, nullptr, 'u'},
                                            {"verbose", no_argument, nullptr, 'v'},
                                            {nullptr, 0, nullptr, 0}};
@@ -172,18 +91,30 @@ int main(int argc, char* argv[]) {
         std::string input_filename;
         std::string output_filename;
         std::string output_format{"SQLite"};
+        std::string memory_log_filename;
+        std::string dictionary_keys;
         unsigned long features_per_transaction = 100000;
         const bool debug = false;
 
         config cfg;
 
         while (true) {
-            int const c = getopt_long(argc, argv, "f:F:hmo:uv", long_options, nullptr);
+            int const c = getopt_long(argc, argv, "a:cD::f:F:hmM:o:rt:uv", long_options, nullptr);
             if (c == -1) {
                 break;
             }
 
             switch (c) {
+            case 'a':
+                cfg.arrow_batch_size = std::stoul(optarg);
+                break;
+            case 'c':
+                cfg.clip_tiles = true;
+                break;
+            case 'D':
+                cfg.dictionary = true;
+                dictionary_keys = optarg ? optarg : default_dictionary_keys;
+                break;
             case 'f':
                 output_format = optarg;
                 break;
@@ -196,9 +127,22 @@ int main(int argc, char* argv[]) {
             case 'm':
                 cfg.add_metadata = true;
                 break;
+            case 'M':
+                memory_log_filename = optarg;
+                break;
             case 'o':
                 output_filename = optarg;
                 break;
+            case 'r':
+                cfg.add_routes = true;
+                break;
+            case 't':
+                cfg.tiles_zoom = std::stoi(optarg);
+                if (cfg.tiles_zoom < 0) {
+                    std::cerr << "Zoom level for --tiles can not be negative\n";
+                    return 2;
+                }
+                break;
             case 'u':
                 cfg.add_untagged_nodes = true;
                 break;
@@ -218,6 +162,30 @@ int main(int argc, char* argv[]) {
 
         input_filename = argv[optind];
 
+        std::string_view keys{dictionary_keys};
+        while (!keys.empty()) {
+            const auto comma = std::min(keys.find(','), keys.size());
+            if (comma > 0) {
+                cfg.dictionary_keys.emplace_back(keys.substr(0, comma));
+            }
+            keys.remove_prefix(std::min(comma + 1, keys.size()));
+        }
+        std::sort(cfg.dictionary_keys.begin(), cfg.dictionary_keys.end());
+
+        const bool tiled = cfg.tiles_zoom >= 0;
+        if (cfg.clip_tiles && !tiled) {
+            std::cerr << "Can not use --clip without --tiles\n";
+            return 2;
+        }
+        if (tiled && cfg.arrow_batch_size) {
+            std::cerr << "Can not use --tiles and --arrow-batch-size together\n";
+            return 2;
+        }
+        if (tiled && cfg.dictionary) {
+            std::cerr << "Can not use --tiles and --dictionary together\n";
+            return 2;
+        }
+
         if (output_filename.empty()) {
             auto slash = input_filename.rfind('/');
             if (slash == std::string::npos) {
@@ -230,7 +198,9 @@ int main(int argc, char* argv[]) {
             if (dot != std::string::npos) {
                 output_filename.erase(dot);
             }
-            output_filename.append(".db");
+            if (!tiled) {
+                output_filename.append(".db");
+            }
         }
 
         osmium::util::VerboseOutput vout{cfg.verbose};
@@ -242,37 +212,103 @@ int main(int argc, char* argv[]) {
         if (debug) {
             assembler_config.debug_level = 1;
         }
-        osmium::area::MultipolygonManager<osmium::area::Assembler> mp_manager{assembler_config};
+
+        // Areas from closed ways are created by the handler, which only
+        // needs the assembler if the way is not a simple ring.
+        osmium::area::Assembler::config_type mp_assembler_config{assembler_config};
+        mp_assembler_config.create_way_polygons = false;
+        osmium::area::MultipolygonManager<osmium::area::Assembler> mp_manager{mp_assembler_config};
+        AreaRelationMembers area_members;
+
+        osmium::geom::OGRFactory<> factory {};
+
+        // Must use the same projection as the handler, so that routes end
+        // up in the same CRS as the other layers.
+        RouteManager<decltype(factory)::projection_type> route_manager;
+
+        index_type index_pos;
+
+        MemoryAccounting memory_accounting{cfg.verbose || !memory_log_filename.empty(), memory_log_filename, std::chrono::seconds{1}};
+        memory_accounting.add_source("location_index", [&index_pos]() {
+            return index_pos.used_memory();
+        });
+        memory_accounting.add_source("mp_relations", [&mp_manager]() {
+            return mp_manager.used_memory().relations_db;
+        });
+        memory_accounting.add_source("mp_members", [&mp_manager]() {
+            return mp_manager.used_memory().members_db;
+        });
+        memory_accounting.add_source("mp_stash", [&mp_manager]() {
+            return mp_manager.used_memory().stash;
+        });
+        memory_accounting.add_source("area_members", [&area_members]() {
+            return area_members.used_memory();
+        });
+        memory_accounting.add_source("routes", [&route_manager]() {
+            return route_manager.used_memory();
+        });
 
         vout << "Pass 1...\n";
-        osmium::relations::read_relations(input_file, mp_manager);
+        memory_accounting.start_phase("pass1");
+        if (cfg.add_routes) {
+            osmium::relations::read_relations(input_file, mp_manager, area_members, route_manager, memory_accounting.handler());
+        } else {
+            osmium::relations::read_relations(input_file, mp_manager, area_members, memory_accounting.handler());
+        }
         vout << "Pass 1 done\n";
 
-        index_type index_pos;
         location_handler_type location_handler{index_pos};
         location_handler.ignore_errors();
 
-        osmium::geom::OGRFactory<> factory {};
-
         CPLSetConfigOption("OGR_SQLITE_SYNCHRONOUS", "OFF");
-        gdalcpp::Dataset dataset{output_format, output_filename, gdalcpp::SRS{factory.proj_string()}, { "SPATIALITE=TRUE", "INIT_WITH_EPSG=no" }};
-        dataset.exec("PRAGMA journal_mode = OFF;");
-        if (features_per_transaction) {
+        const std::vector<std::string> dataset_options{"SPATIALITE=TRUE", "INIT_WITH_EPSG=no"};
+
+        // gdalcpp only registers the drivers when the first dataset is
+        // created, but the driver lookups below happen before that.
+        GDALAllRegister();
+
+        // In tiled mode the layers in the main dataset are only used to
+        // define the schema, features go into the tile datasets.
+        std::unique_ptr<TiledOutput> tiles;
+        if (tiled) {
+            tiles = std::make_unique<TiledOutput>(output_filename, output_format, dataset_options, static_cast<uint32_t>(cfg.tiles_zoom), cfg.clip_tiles);
+        }
+
+        const char* memory_driver = GetGDALDriverManager()->GetDriverByName("Memory") ? "Memory" : "MEM";
+        gdalcpp::Dataset dataset{tiled ? memory_driver : output_format,
+                                 tiled ? "" : output_filename,
+                                 gdalcpp::SRS{factory.proj_string()},
+                                 tiled ? std::vector<std::string>{} : dataset_options};
+        if (!tiled) {
+            dataset.exec("PRAGMA journal_mode = OFF;");
+        }
+        // Each Arrow batch is written in a single call, so the automatic
+        // per-feature transactions do not apply then.
+        if (features_per_transaction && !cfg.arrow_batch_size && !tiled) {
             dataset.enable_auto_transactions(features_per_transaction);
         }
 
-        MyOGRHandler<decltype(factory)::projection_type> ogr_handler(dataset, factory, cfg);
+        MyOGRHandler<decltype(factory)::projection_type> ogr_handler(dataset, factory, cfg, assembler_config, area_members, tiles.get());
 
         vout << "Pass 2...\n";
+        memory_accounting.start_phase("pass2");
         osmium::io::Reader reader{input_file};
 
         osmium::apply(reader, location_handler, ogr_handler, mp_manager.handler([&ogr_handler](const osmium::memory::Buffer& area_buffer) {
             osmium::apply(area_buffer, ogr_handler);
-        }));
+        }), route_manager.handler([&ogr_handler](const osmium::Relation& relation, const decltype(route_manager)& routes) {
+            ogr_handler.route(relation, routes);
+        }), memory_accounting.handler());
 
         reader.close();
+        memory_accounting.start_phase("finish");
+        ogr_handler.finish();
         vout << "Pass 2 done\n";
 
+        if (tiles) {
+            vout << "Wrote " << tiles->num_tiles_written() << " tiles\n";
+        }
+
         std::vector<osmium::object_id_type> incomplete_relations_ids;
         mp_manager.for_each_incomplete_relation([&](const osmium::relations::RelationHandle& handle){
             incomplete_relations_ids.push_back(handle->id());
@@ -285,6 +321,20 @@ int main(int argc, char* argv[]) {
             std::cerr << "\n";
         }
 
+        std::vector<osmium::object_id_type> incomplete_route_ids;
+        route_manager.for_each_incomplete_route([&](const osmium::Relation& relation){
+            incomplete_route_ids.push_back(relation.id());
+        });
+        if (!incomplete_route_ids.empty()) {
+            std::cerr << "Warning! Some member ways missing for these route relations:";
+            for (const auto id : incomplete_route_ids) {
+                std::cerr << " " << id;
+            }
+            std::cerr << "\n";
+        }
+
+        memory_accounting.print_summary(std::cerr);
+
         const osmium::MemoryUsage memory;
         if (memory.peak()) {
             vout << "Memory used: " << memory.peak() << " MBytes\n";
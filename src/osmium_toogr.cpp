@@ -7,14 +7,25 @@
 
 #include <gdalcpp.hpp>
 
+#include <protozero/varint.hpp>
+
 #include <osmium/geom/ogr.hpp>
 #include <osmium/handler.hpp>
 #include <osmium/handler/node_locations_for_ways.hpp>
+#include <osmium/index/index.hpp>
+#include <osmium/index/map.hpp>
 #include <osmium/index/map/all.hpp> // IWYU pragma: keep
 #include <osmium/io/any_input.hpp> // IWYU pragma: keep
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/node_ref.hpp>
+#include <osmium/osm/way.hpp>
 #include <osmium/visitor.hpp>
 
+#include <algorithm>
 #include <cerrno>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <exception>
@@ -23,6 +34,9 @@
 #include <iostream>
 #include <string>
 #include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #ifndef _MSC_VER
 # include <unistd.h>
@@ -31,6 +45,242 @@
 using index_type = osmium::index::map::Map<osmium::unsigned_object_id_type, osmium::Location>;
 using location_handler_type = osmium::handler::NodeLocationsForWays<index_type>;
 
+/**
+ * Node location store keeping IDs and coordinates compressed in memory.
+ *
+ * Entries are grouped into blocks of block_size entries. For each block
+ * a skip entry holds the first ID and location uncompressed and the
+ * offset of the rest of the block in the data buffer. There the
+ * remaining entries are stored as varint encoded ID deltas and zigzag
+ * varint encoded coordinate deltas. A lookup does a binary search over
+ * the skip entries and then decodes at most one block.
+ *
+ * This works best if IDs are set in ascending order, as they are in
+ * sorted OSM files. Out-of-order entries are kept uncompressed in a
+ * separate list which is sorted when sort() is called.
+ */
+template <typename TId, typename TValue>
+class CompressedMem : public osmium::index::map::Map<TId, TValue> {
+
+    static_assert(std::is_same<TValue, osmium::Location>::value, "CompressedMem can only store locations");
+
+    static constexpr std::size_t block_size = 128;
+
+    struct block {
+        TId id;
+        int32_t x;
+        int32_t y;
+        std::size_t offset;
+    };
+
+    using entry = std::pair<TId, TValue>;
+
+    std::vector<block> m_blocks;
+    std::string m_data;
+    std::vector<entry> m_pending;
+    std::vector<entry> m_unsorted;
+    std::size_t m_size = 0;
+    TId m_last_id = 0;
+
+    void compress_pending() {
+        if (m_pending.empty()) {
+            return;
+        }
+
+        const auto& first = m_pending.front();
+        m_blocks.push_back(block{first.first, first.second.x(), first.second.y(), m_data.size()});
+
+        auto last = first;
+        for (auto it = std::next(m_pending.begin()); it != m_pending.end(); ++it) {
+            protozero::add_varint_to_buffer(&m_data, it->first - last.first);
+            protozero::add_varint_to_buffer(&m_data, protozero::encode_zigzag64(static_cast<int64_t>(it->second.x()) - last.second.x()));
+            protozero::add_varint_to_buffer(&m_data, protozero::encode_zigzag64(static_cast<int64_t>(it->second.y()) - last.second.y()));
+            last = *it;
+        }
+
+        m_pending.clear();
+    }
+
+    static bool compare_id(const entry& e, const TId id) noexcept {
+        return e.first < id;
+    }
+
+    TValue find_in(const std::vector<entry>& entries, const TId id) const noexcept {
+        const auto it = std::lower_bound(entries.begin(), entries.end(), id, compare_id);
+        if (it != entries.end() && it->first == id) {
+            return it->second;
+        }
+        return TValue{};
+    }
+
+    TValue find_in_blocks(const TId id) const noexcept {
+        auto it = std::upper_bound(m_blocks.begin(), m_blocks.end(), id, [](const TId i, const block& b) {
+            return i < b.id;
+        });
+        if (it == m_blocks.begin()) {
+            return TValue{};
+        }
+        --it;
+
+        TId current_id = it->id;
+        int64_t x = it->x;
+        int64_t y = it->y;
+
+        const char* data = m_data.data() + it->offset;
+        const char* const end = m_data.data() + (std::next(it) == m_blocks.end() ? m_data.size() : std::next(it)->offset);
+
+        while (current_id < id && data != end) {
+            current_id += protozero::decode_varint(&data, end);
+            x += protozero::decode_zigzag64(protozero::decode_varint(&data, end));
+            y += protozero::decode_zigzag64(protozero::decode_varint(&data, end));
+        }
+
+        if (current_id == id) {
+            return TValue{static_cast<int32_t>(x), static_cast<int32_t>(y)};
+        }
+        return TValue{};
+    }
+
+public:
+
+    CompressedMem() = default;
+
+    ~CompressedMem() noexcept override = default;
+
+    void set(const TId id, const TValue value) final {
+        if (m_size++ > 0 && id <= m_last_id) {
+            m_unsorted.emplace_back(id, value);
+            return;
+        }
+
+        if (m_pending.size() == block_size) {
+            compress_pending();
+        }
+        m_pending.emplace_back(id, value);
+        m_last_id = id;
+    }
+
+    TValue get(const TId id) const final {
+        const TValue value = get_noexcept(id);
+        if (value == TValue{}) {
+            throw osmium::not_found{id};
+        }
+        return value;
+    }
+
+    TValue get_noexcept(const TId id) const noexcept final {
+        TValue value{};
+        if (!m_pending.empty() && id >= m_pending.front().first) {
+            value = find_in(m_pending, id);
+        } else {
+            value = find_in_blocks(id);
+        }
+        if (value == TValue{} && !m_unsorted.empty()) {
+            value = find_in(m_unsorted, id);
+        }
+        return value;
+    }
+
+    std::size_t size() const final {
+        return m_size;
+    }
+
+    std::size_t used_memory() const final {
+        return sizeof(block) * m_blocks.capacity() +
+               m_data.capacity() +
+               sizeof(entry) * (m_pending.capacity() + m_unsorted.capacity());
+    }
+
+    void clear() final {
+        m_blocks.clear();
+        m_blocks.shrink_to_fit();
+        m_data.clear();
+        m_data.shrink_to_fit();
+        m_pending.clear();
+        m_unsorted.clear();
+        m_unsorted.shrink_to_fit();
+        m_size = 0;
+        m_last_id = 0;
+    }
+
+    void sort() final {
+        std::sort(m_unsorted.begin(), m_unsorted.end(), [](const entry& a, const entry& b) {
+            return a.first < b.first;
+        });
+    }
+
+}; // class CompressedMem
+
+REGISTER_MAP(osmium::unsigned_object_id_type, osmium::Location, CompressedMem, compressed_mem)
+
+/**
+ * Alternative to osmium::handler::NodeLocationsForWays working on whole
+ * buffers. Node locations are stored in the index as usual. But instead
+ * of looking up the nodes of each way one by one, the node refs of all
+ * ways in a buffer are gathered, sorted by ID, and looked up in a single
+ * sweep through the index in ascending ID order, each distinct node only
+ * once. The locations are then written back into the node refs. This
+ * gives much better locality for large or disk-based indexes.
+ *
+ * As with NodeLocationsForWays::ignore_errors(), locations of missing
+ * nodes are left undefined. Nodes with negative IDs are ignored.
+ */
+template <typename TIndex>
+class BatchedNodeLocationsForWays {
+
+    TIndex& m_index;
+    std::vector<std::pair<osmium::unsigned_object_id_type, osmium::NodeRef*>> m_node_refs;
+    bool m_must_sort = true;
+
+public:
+
+    explicit BatchedNodeLocationsForWays(TIndex& index) :
+        m_index(index) {
+    }
+
+    void apply(osmium::memory::Buffer& buffer) {
+        m_node_refs.clear();
+
+        for (auto& entity : buffer) {
+            if (entity.type() == osmium::item_type::node) {
+                const auto& node = static_cast<const osmium::Node&>(entity);
+                if (node.id() >= 0) {
+                    m_index.set(static_cast<osmium::unsigned_object_id_type>(node.id()), node.location());
+                }
+            } else if (entity.type() == osmium::item_type::way) {
+                for (auto& node_ref : static_cast<osmium::Way&>(entity).nodes()) {
+                    if (node_ref.ref() >= 0) {
+                        m_node_refs.emplace_back(static_cast<osmium::unsigned_object_id_type>(node_ref.ref()), &node_ref);
+                    }
+                }
+            }
+        }
+
+        if (m_node_refs.empty()) {
+            return;
+        }
+
+        if (m_must_sort) {
+            m_index.sort();
+            m_must_sort = false;
+        }
+
+        std::sort(m_node_refs.begin(), m_node_refs.end(), [](const auto& a, const auto& b) {
+            return a.first < b.first;
+        });
+
+        auto it = m_node_refs.begin();
+        while (it != m_node_refs.end()) {
+            const auto id = it->first;
+            const osmium::Location location = m_index.get_noexcept(id);
+            for (; it != m_node_refs.end() && it->first == id; ++it) {
+                it->second->set_location(location);
+            }
+        }
+    }
+
+}; // class BatchedNodeLocationsForWays
+
 class MyOGRHandler : public osmium::handler::Handler {
 
     gdalcpp::Layer m_layer_point;
@@ -85,9 +335,13 @@ void print_help() {
               << "If OUTFILE is not given 'ogr_out' is used.\n" \
               << "\nOptions:\n" \
               << "  -h, --help                 This help message\n" \
+              << "  -b, --batched_lookups      Look up node locations for all ways in\n" \
+              << "                             a buffer at once in ID order\n" \
               << "  -l, --location_store=TYPE  Set location store\n" \
               << "  -f, --format=FORMAT        Output OGR format (Default: 'SQLite')\n" \
-              << "  -L                         See available location stores\n";
+              << "  -L                         See available location stores\n" \
+              << "                             ('compressed_mem' keeps locations\n" \
+              << "                             compressed in memory)\n";
 }
 
 int main(int argc, char* argv[]) {
@@ -96,6 +350,7 @@ int main(int argc, char* argv[]) {
 
         static struct option long_options[] = {
             {"help",                 no_argument,       nullptr, 'h'},
+            {"batched_lookups",      no_argument,       nullptr, 'b'},
             {"format",               required_argument, nullptr, 'f'},
             {"location_store",       required_argument, nullptr, 'l'},
             {"list_location_stores", no_argument,       nullptr, 'L'},
@@ -104,9 +359,10 @@ int main(int argc, char* argv[]) {
 
         std::string output_format{"SQLite"};
         std::string location_store{"flex_mem"};
+        bool batched_lookups = false;
 
         while (true) {
-            const int c = getopt_long(argc, argv, "hf:l:L", long_options, nullptr);
+            const int c = getopt_long(argc, argv, "hbf:l:L", long_options, nullptr);
             if (c == -1) {
                 break;
             }
@@ -115,6 +371,9 @@ int main(int argc, char* argv[]) {
                 case 'h':
                     print_help();
                     return 0;
+                case 'b':
+                    batched_lookups = true;
+                    break;
                 case 'f':
                     output_format = optarg;
                     break;
@@ -159,7 +418,15 @@ int main(int argc, char* argv[]) {
         gdalcpp::Dataset dataset{output_format, output_filename, gdalcpp::SRS{}, { "SPATIALITE=TRUE", "INIT_WITH_EPSG=no" }};
         MyOGRHandler ogr_handler{dataset};
 
-        osmium::apply(reader, location_handler, ogr_handler);
+        if (batched_lookups) {
+            BatchedNodeLocationsForWays<index_type> batched_location_handler{*index};
+            while (osmium::memory::Buffer buffer = reader.read()) {
+                batched_location_handler.apply(buffer);
+                osmium::apply(buffer, ogr_handler);
+            }
+        } else {
+            osmium::apply(reader, location_handler, ogr_handler);
+        }
         reader.close();
 
         /*
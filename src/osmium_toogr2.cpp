@@ -8,6 +8,10 @@
 
 */
 
+#include "memory_accounting.hpp"
+#include "simple_ring.hpp"
+#include "string_dictionary.hpp"
+
 #include <gdalcpp.hpp>
 
 #include <osmium/area/assembler.hpp>
@@ -18,20 +22,59 @@
 #include <osmium/handler/node_locations_for_ways.hpp>
 #include <osmium/index/map/flex_mem.hpp> // IWYU pragma: keep
 #include <osmium/io/any_input.hpp> // IWYU pragma: keep
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/box.hpp>
+#include <osmium/osm/location.hpp>
 #include <osmium/util/memory.hpp>
 #include <osmium/visitor.hpp>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <exception>
+#include <filesystem>
+#include <functional>
 #include <getopt.h>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#ifndef _WIN32
+# include <sys/socket.h>
+# include <sys/stat.h>
+# include <sys/un.h>
+# include <unistd.h>
+#endif
+
 using index_type = osmium::index::map::FlexMem<osmium::unsigned_object_id_type, osmium::Location>;
 using location_handler_type = osmium::handler::NodeLocationsForWays<index_type>;
 
+/// Layers written by MyOGRHandler, all by default.
+struct layer_selection {
+    bool postboxes = true;
+    bool roads = true;
+    bool buildings = true;
+};
+
 template <class TProjection>
 class MyOGRHandler : public osmium::handler::Handler {
 
@@ -41,27 +84,97 @@ class MyOGRHandler : public osmium::handler::Handler {
 
     osmium::geom::OGRFactory<TProjection>& m_factory;
 
+    osmium::area::Assembler::config_type m_assembler_config;
+    const AreaRelationMembers& m_area_members;
+    layer_selection m_layers;
+    osmium::memory::Buffer m_area_buffer{10240, osmium::memory::Buffer::auto_grow::yes};
+
+    // Only used if types are written as dictionary codes
+    std::unique_ptr<StringDictionary> m_road_types;
+    std::unique_ptr<StringDictionary> m_building_types;
+
+    static void set_type(gdalcpp::Feature& feature, StringDictionary* dictionary, const char* type) {
+        if (dictionary) {
+            feature.set_field("type", dictionary->code(type));
+        } else {
+            feature.set_field("type", type);
+        }
+    }
+
+    void add_building(const osmium::OSMObject& object, osmium::object_id_type id, const char* building, std::unique_ptr<OGRMultiPolygon>&& geometry) {
+        gdalcpp::Feature feature{m_layer_polygon, std::move(geometry)};
+        feature.set_field("id", static_cast<double>(id));
+        set_type(feature, m_building_types.get(), building);
+        feature.add_to_layer();
+    }
+
+    /**
+     * Create building from closed way. The MultipolygonManager is
+     * configured not to do this, so that simple rings can be written
+     * directly. Only if that isn't possible the assembler is used.
+     */
+    void way_area(const osmium::Way& way, const char* building) {
+        if (!is_area_way(way, m_area_members)) {
+            return;
+        }
+
+        const int orientation = simple_ring_orientation(way.nodes());
+        if (orientation != 0) {
+            try {
+                // Outer rings are written counter-clockwise like the
+                // assembler does.
+                auto multipolygon = std::make_unique<OGRMultiPolygon>();
+                multipolygon->addGeometryDirectly(m_factory.create_polygon(way, osmium::geom::use_nodes::all,
+                                                                           orientation > 0 ? osmium::geom::direction::forward
+                                                                                           : osmium::geom::direction::backward).release());
+                add_building(way, osmium::object_id_to_area_id(way.id(), osmium::item_type::way), building, std::move(multipolygon));
+                return;
+            } catch (const osmium::geometry_error&) {
+                // fall back to the assembler
+            }
+        }
+
+        try {
+            osmium::area::Assembler assembler{m_assembler_config};
+            assembler(way, m_area_buffer);
+            osmium::apply(m_area_buffer, *this);
+        } catch (const osmium::invalid_location&) {
+            // ignore like the MultipolygonManager does
+        }
+        m_area_buffer.clear();
+    }
+
 public:
 
-    MyOGRHandler(gdalcpp::Dataset& dataset, osmium::geom::OGRFactory<TProjection>& factory) :
+    MyOGRHandler(gdalcpp::Dataset& dataset, osmium::geom::OGRFactory<TProjection>& factory, const osmium::area::Assembler::config_type& assembler_config, const AreaRelationMembers& area_members, bool dictionary, const layer_selection& layers = layer_selection{}) :
         m_layer_point(dataset, "postboxes", wkbPoint),
         m_layer_linestring(dataset, "roads", wkbLineString),
         m_layer_polygon(dataset, "buildings", wkbMultiPolygon),
-        m_factory(factory) {
+        m_factory(factory),
+        m_assembler_config(assembler_config),
+        m_area_members(area_members),
+        m_layers(layers) {
 
         m_layer_point.add_field("id", OFTReal, 10);
         m_layer_point.add_field("operator", OFTString, 30);
 
         m_layer_linestring.add_field("id", OFTReal, 10);
-        m_layer_linestring.add_field("type", OFTString, 30);
-
         m_layer_polygon.add_field("id", OFTReal, 10);
-        m_layer_polygon.add_field("type", OFTString, 30);
+
+        if (dictionary) {
+            m_road_types = std::make_unique<StringDictionary>();
+            m_building_types = std::make_unique<StringDictionary>();
+            m_layer_linestring.add_field("type", OFTInteger, 10);
+            m_layer_polygon.add_field("type", OFTInteger, 10);
+        } else {
+            m_layer_linestring.add_field("type", OFTString, 30);
+            m_layer_polygon.add_field("type", OFTString, 30);
+        }
     }
 
     void node(const osmium::Node& node) {
         const char* amenity = node.tags()["amenity"];
-        if (amenity && !std::strcmp(amenity, "post_box")) {
+        if (m_layers.postboxes && amenity && !std::strcmp(amenity, "post_box")) {
             gdalcpp::Feature feature{m_layer_point, m_factory.create_point(node)};
             feature.set_field("id", static_cast<double>(node.id()));
             feature.set_field("operator", node.tags().get_value_by_key("operator"));
@@ -71,26 +184,28 @@ public:
 
     void way(const osmium::Way& way) {
         const char* highway = way.tags()["highway"];
-        if (highway) {
+        if (highway && m_layers.roads) {
             try {
                 gdalcpp::Feature feature{m_layer_linestring, m_factory.create_linestring(way)};
                 feature.set_field("id", static_cast<double>(way.id()));
-                feature.set_field("type", highway);
+                set_type(feature, m_road_types.get(), highway);
                 feature.add_to_layer();
             } catch (const osmium::geometry_error&) {
                 std::cerr << "Ignoring illegal geometry for way " << way.id() << ".\n";
             }
         }
+
+        const char* building = way.tags()["building"];
+        if (building && m_layers.buildings) {
+            way_area(way, building);
+        }
     }
 
     void area(const osmium::Area& area) {
         const char* building = area.tags()["building"];
-        if (building) {
+        if (building && m_layers.buildings) {
             try {
-                gdalcpp::Feature feature{m_layer_polygon, m_factory.create_multipolygon(area)};
-                feature.set_field("id", static_cast<double>(area.id()));
-                feature.set_field("type", building);
-                feature.add_to_layer();
+                add_building(area, area.id(), building, m_factory.create_multipolygon(area));
             } catch (const osmium::geometry_error&) {
                 std::cerr << "Ignoring illegal geometry for area "
                           << area.id()
@@ -102,8 +217,551 @@ public:
         }
     }
 
+    /// Write lookup tables for dictionary encoded types, if any.
+    void write_lookup_tables(gdalcpp::Dataset& dataset) const {
+        if (m_road_types) {
+            m_road_types->write(dataset, "roads_type");
+        }
+        if (m_building_types) {
+            m_building_types->write(dataset, "buildings_type");
+        }
+    }
+
 };
 
+/**
+ * The objects written by MyOGRHandler with all node locations in place
+ * and multipolygon relations already assembled into areas, together with
+ * their bounding boxes. Used by the server mode to answer export requests
+ * without reading the input file again.
+ *
+ * Objects are found through a fixed grid over the world. Each cell lists
+ * the objects whose bounding box overlaps it. Objects spanning too many
+ * cells are kept in a separate list that is checked for every request.
+ * Call build_index() after all objects have been added.
+ */
+class Snapshot : public osmium::handler::Handler {
+
+    struct item {
+        osmium::Box envelope;
+        std::size_t offset; // of the object in m_buffer
+    };
+
+    static constexpr const uint32_t grid_size = 2048;
+    static constexpr const uint32_t max_cells_per_item = 64;
+
+    osmium::memory::Buffer m_buffer{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+    std::vector<item> m_items;
+
+    // The items overlapping grid cell c are listed in m_cell_items from
+    // m_cell_offsets[c] to m_cell_offsets[c + 1].
+    std::vector<std::size_t> m_cell_offsets;
+    std::vector<uint32_t> m_cell_items;
+    std::vector<uint32_t> m_large_items;
+
+    AreaRelationMembers m_area_members;
+
+    static uint32_t cell(int32_t coordinate, int64_t max) noexcept {
+        constexpr const int64_t precision = osmium::detail::coordinate_precision;
+        const int64_t c = (int64_t{coordinate} + max * precision) * grid_size / (2 * max * precision);
+        return static_cast<uint32_t>(std::clamp<int64_t>(c, 0, grid_size - 1));
+    }
+
+    static uint32_t cell_x(int32_t x) noexcept {
+        return cell(x, 180);
+    }
+
+    static uint32_t cell_y(int32_t y) noexcept {
+        return cell(y, 90);
+    }
+
+    static std::size_t cell_index(uint32_t x, uint32_t y) noexcept {
+        return std::size_t{y} * grid_size + x;
+    }
+
+    // Call func with the index of all cells the item is listed in.
+    // Returns false for large items, which aren't in any cell.
+    template <typename TFunc>
+    static bool for_each_cell(const item& i, TFunc&& func) {
+        const uint32_t x0 = cell_x(i.envelope.bottom_left().x());
+        const uint32_t x1 = cell_x(i.envelope.top_right().x());
+        const uint32_t y0 = cell_y(i.envelope.bottom_left().y());
+        const uint32_t y1 = cell_y(i.envelope.top_right().y());
+        if (std::size_t{x1 - x0 + 1} * (y1 - y0 + 1) > max_cells_per_item) {
+            return false;
+        }
+        for (uint32_t y = y0; y <= y1; ++y) {
+            for (uint32_t x = x0; x <= x1; ++x) {
+                std::forward<TFunc>(func)(cell_index(x, y));
+            }
+        }
+        return true;
+    }
+
+    static bool overlaps(const osmium::Box& a, const osmium::Box& b) noexcept {
+        return a.bottom_left().x() <= b.top_right().x() && b.bottom_left().x() <= a.top_right().x() &&
+               a.bottom_left().y() <= b.top_right().y() && b.bottom_left().y() <= a.top_right().y();
+    }
+
+    void add(const osmium::OSMObject& object, const osmium::Box& envelope) {
+        if (!envelope.valid()) {
+            return;
+        }
+        const auto offset = m_buffer.committed();
+        m_buffer.add_item(object);
+        m_buffer.commit();
+        m_items.push_back(item{envelope, offset});
+    }
+
+public:
+
+    // These must select (at least) the objects MyOGRHandler writes.
+
+    void node(const osmium::Node& node) {
+        const char* amenity = node.tags()["amenity"];
+        if (amenity && !std::strcmp(amenity, "post_box")) {
+            add(node, osmium::Box{}.extend(node.location()));
+        }
+    }
+
+    void way(const osmium::Way& way) {
+        if (way.tags().has_key("highway") || way.tags().has_key("building")) {
+            add(way, way.envelope());
+        }
+    }
+
+    void area(const osmium::Area& area) {
+        if (area.tags().has_key("building")) {
+            add(area, area.envelope());
+        }
+    }
+
+    std::size_t size() const noexcept {
+        return m_items.size();
+    }
+
+    /// Member ways of multipolygon relations, filled in the first pass.
+    AreaRelationMembers& area_members() noexcept {
+        return m_area_members;
+    }
+
+    const AreaRelationMembers& area_members() const noexcept {
+        return m_area_members;
+    }
+
+    void build_index() {
+        if (m_items.size() > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error{"Too many objects for snapshot index"};
+        }
+
+        // Count items per cell first, then fill them in.
+        m_cell_offsets.assign(std::size_t{grid_size} * grid_size + 1, 0);
+        m_large_items.clear();
+        for (uint32_t n = 0; n < m_items.size(); ++n) {
+            if (!for_each_cell(m_items[n], [&](std::size_t c) { ++m_cell_offsets[c + 1]; })) {
+                m_large_items.push_back(n);
+            }
+        }
+        for (std::size_t c = 1; c < m_cell_offsets.size(); ++c) {
+            m_cell_offsets[c] += m_cell_offsets[c - 1];
+        }
+
+        m_cell_items.resize(m_cell_offsets.back());
+        std::vector<std::size_t> next{m_cell_offsets.begin(), m_cell_offsets.end() - 1};
+        for (uint32_t n = 0; n < m_items.size(); ++n) {
+            for_each_cell(m_items[n], [&](std::size_t c) { m_cell_items[next[c]++] = n; });
+        }
+    }
+
+    /// Apply handler to all objects overlapping the box, returns their number.
+    template <typename THandler>
+    std::size_t apply(const osmium::Box& box, THandler& handler) const {
+        std::size_t count = 0;
+        const auto visit = [&](const item& i) {
+            osmium::apply_item(m_buffer.get<osmium::OSMObject>(i.offset), handler);
+            ++count;
+        };
+
+        for (const auto n : m_large_items) {
+            if (overlaps(m_items[n].envelope, box)) {
+                visit(m_items[n]);
+            }
+        }
+
+        const uint32_t x0 = cell_x(box.bottom_left().x());
+        const uint32_t x1 = cell_x(box.top_right().x());
+        const uint32_t y0 = cell_y(box.bottom_left().y());
+        const uint32_t y1 = cell_y(box.top_right().y());
+        for (uint32_t y = y0; y <= y1; ++y) {
+            for (uint32_t x = x0; x <= x1; ++x) {
+                const auto c = cell_index(x, y);
+                for (auto k = m_cell_offsets[c]; k < m_cell_offsets[c + 1]; ++k) {
+                    const auto& i = m_items[m_cell_items[k]];
+                    if (!overlaps(i.envelope, box)) {
+                        continue;
+                    }
+                    // An item is listed in all cells it overlaps. Only
+                    // visit it from the cell containing the lower left
+                    // corner of its intersection with the box.
+                    if (cell_x(std::max(i.envelope.bottom_left().x(), box.bottom_left().x())) != x ||
+                        cell_y(std::max(i.envelope.bottom_left().y(), box.bottom_left().y())) != y) {
+                        continue;
+                    }
+                    visit(i);
+                }
+            }
+        }
+
+        return count;
+    }
+
+}; // class Snapshot
+
+/**
+ * Read the input file in two passes like the normal export does, but
+ * collect the objects into a snapshot instead of writing them out. The
+ * location index is only needed while reading.
+ */
+std::unique_ptr<Snapshot> load_snapshot(const osmium::io::File& input_file, const osmium::area::Assembler::config_type& mp_assembler_config) {
+    auto snapshot = std::make_unique<Snapshot>();
+
+    osmium::area::MultipolygonManager<osmium::area::Assembler> mp_manager{mp_assembler_config};
+    osmium::relations::read_relations(input_file, mp_manager, snapshot->area_members());
+
+    index_type index;
+    location_handler_type location_handler{index};
+    location_handler.ignore_errors();
+
+    osmium::io::Reader reader{input_file};
+    osmium::apply(reader, location_handler, *snapshot, mp_manager.handler([&snapshot](const osmium::memory::Buffer& area_buffer) {
+        osmium::apply(area_buffer, *snapshot);
+    }));
+    reader.close();
+
+    snapshot->build_index();
+    return snapshot;
+}
+
+#ifndef _WIN32
+
+/**
+ * Keeps a snapshot of the input file in memory and answers export
+ * requests on a unix domain socket. A request is a single line
+ *
+ *   MINLON MINLAT MAXLON MAXLAT LAYERS OUTFILE [FORMAT]
+ *
+ * where LAYERS is "all" or a comma separated list of layer names. All
+ * objects overlapping the box are written to the new dataset OUTFILE in
+ * the output directory given on startup. OUTFILE must be a plain file
+ * name that doesn't exist yet, so clients can't write anywhere else or
+ * overwrite existing files. The socket is only accessible by the user
+ * running the server. The answer is "OK NUM" with the number of objects written or
+ * "ERROR MESSAGE", a failed request doesn't leave a file behind. Requests are handled concurrently, each in its own
+ * thread with its own dataset. When the input file changes, a new
+ * snapshot is loaded in the background and used for all later requests.
+ */
+class ExportServer {
+
+    static constexpr const std::size_t max_request_size = 4096;
+    static constexpr const std::size_t max_concurrent_requests = 8;
+    static constexpr const std::chrono::seconds poll_interval{10};
+
+    std::string m_input_filename;
+    std::string m_output_directory;
+    std::string m_output_format;
+    osmium::area::Assembler::config_type m_assembler_config;
+    bool m_dictionary;
+
+    // Modification time of the input file before the current snapshot
+    // was loaded. Only used by the thread watching the input file.
+    std::filesystem::file_time_type m_mtime;
+
+    std::mutex m_mutex;
+    std::shared_ptr<const Snapshot> m_snapshot;
+    std::atomic<std::size_t> m_active_requests{0};
+
+    // Output files of the requests in progress. Checking that a file
+    // doesn't exist isn't enough, two requests could both pass that
+    // check before either creates the file.
+    std::mutex m_outputs_mutex;
+    std::unordered_set<std::string> m_outputs;
+
+    /**
+     * Reserves the name of an output file for one request. Fails if the
+     * file exists or another request reserved it.
+     */
+    class output_reservation {
+
+        ExportServer& m_server;
+        std::string m_filename;
+
+    public:
+
+        output_reservation(ExportServer& server, std::string filename) :
+            m_server(server),
+            m_filename(std::move(filename)) {
+            const std::lock_guard<std::mutex> lock{m_server.m_outputs_mutex};
+            if (std::filesystem::exists(m_filename) || !m_server.m_outputs.insert(m_filename).second) {
+                throw std::runtime_error{"output file exists"};
+            }
+        }
+
+        output_reservation(const output_reservation&) = delete;
+        output_reservation& operator=(const output_reservation&) = delete;
+
+        output_reservation(output_reservation&&) = delete;
+        output_reservation& operator=(output_reservation&&) = delete;
+
+        ~output_reservation() noexcept {
+            const std::lock_guard<std::mutex> lock{m_server.m_outputs_mutex};
+            m_server.m_outputs.erase(m_filename);
+        }
+
+    }; // class output_reservation
+
+    std::unique_ptr<Snapshot> load() const {
+        osmium::area::Assembler::config_type mp_assembler_config{m_assembler_config};
+        mp_assembler_config.create_way_polygons = false;
+        auto snapshot = load_snapshot(osmium::io::File{m_input_filename}, mp_assembler_config);
+        std::cerr << "Loaded " << snapshot->size() << " objects from '" << m_input_filename << "'\n";
+        return snapshot;
+    }
+
+    std::shared_ptr<const Snapshot> snapshot() {
+        const std::lock_guard<std::mutex> lock{m_mutex};
+        return m_snapshot;
+    }
+
+    /**
+     * Reload snapshot after the modification time of the input file has
+     * changed and then stayed the same for one poll interval, so that a
+     * file still being written isn't read.
+     */
+    void watch_input() {
+        auto seen = m_mtime;
+        while (true) {
+            std::this_thread::sleep_for(poll_interval);
+            try {
+                const auto mtime = std::filesystem::last_write_time(m_input_filename);
+                if (mtime != seen) {
+                    seen = mtime;
+                    continue;
+                }
+                if (mtime == m_mtime) {
+                    continue;
+                }
+                m_mtime = mtime; // don't retry a broken file until it changes again
+                std::shared_ptr<const Snapshot> snapshot{load()};
+                const std::lock_guard<std::mutex> lock{m_mutex};
+                m_snapshot = std::move(snapshot);
+            } catch (const std::exception& e) {
+                std::cerr << "Reloading '" << m_input_filename << "' failed: " << e.what() << '\n';
+            }
+        }
+    }
+
+    static layer_selection parse_layers(const std::string& names) {
+        if (names == "all") {
+            return layer_selection{};
+        }
+
+        layer_selection layers{false, false, false};
+        std::istringstream in{names};
+        std::string name;
+        while (std::getline(in, name, ',')) {
+            if (name == "postboxes") {
+                layers.postboxes = true;
+            } else if (name == "roads") {
+                layers.roads = true;
+            } else if (name == "buildings") {
+                layers.buildings = true;
+            } else {
+                throw std::runtime_error{"unknown layer '" + name + "'"};
+            }
+        }
+        return layers;
+    }
+
+    std::string handle_request(const std::string& request) {
+        std::istringstream in{request};
+        double minlon = 0.0;
+        double minlat = 0.0;
+        double maxlon = 0.0;
+        double maxlat = 0.0;
+        std::string layer_names;
+        std::string output_filename;
+        std::string output_format;
+        if (!(in >> minlon >> minlat >> maxlon >> maxlat >> layer_names >> output_filename)) {
+            throw std::runtime_error{"expected MINLON MINLAT MAXLON MAXLAT LAYERS OUTFILE [FORMAT]"};
+        }
+        if (!(in >> output_format)) {
+            output_format = m_output_format;
+        }
+
+        const osmium::Box box{minlon, minlat, maxlon, maxlat};
+        if (!box.valid() || minlon > maxlon || minlat > maxlat) {
+            throw std::runtime_error{"invalid bounding box"};
+        }
+        const auto layers = parse_layers(layer_names);
+
+        if (output_filename == "." || output_filename == ".." ||
+            output_filename.find('/') != std::string::npos) {
+            throw std::runtime_error{"output file must be a plain file name"};
+        }
+        output_filename.insert(0, m_output_directory + '/');
+        const output_reservation reservation{*this, output_filename};
+
+        std::size_t count = 0;
+        try {
+            count = write_export(box, layers, output_filename, output_format);
+        } catch (...) {
+            // Don't leave a broken file behind. The file didn't exist
+            // before, so whatever is there now was created by this
+            // request.
+            std::error_code ec;
+            std::filesystem::remove_all(output_filename, ec);
+            throw;
+        }
+
+        return "OK " + std::to_string(count) + "\n";
+    }
+
+    std::size_t write_export(const osmium::Box& box, const layer_selection& layers, const std::string& output_filename, const std::string& output_format) {
+        // Keeps the snapshot alive even if it is replaced in the meantime.
+        const auto snapshot = this->snapshot();
+
+        osmium::geom::OGRFactory<osmium::geom::MercatorProjection> factory;
+        gdalcpp::Dataset dataset{output_format, output_filename, gdalcpp::SRS{factory.proj_string()}, { "SPATIALITE=TRUE", "INIT_WITH_EPSG=no" }};
+        MyOGRHandler<decltype(factory)::projection_type> ogr_handler{dataset, factory, m_assembler_config, snapshot->area_members(), m_dictionary, layers};
+
+        const auto count = snapshot->apply(box, ogr_handler);
+        ogr_handler.write_lookup_tables(dataset);
+
+        return count;
+    }
+
+    static void write_all(int fd, const std::string& data) {
+        const char* ptr = data.data();
+        std::size_t size = data.size();
+        while (size > 0) {
+            const auto n = ::write(fd, ptr, size);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return; // client went away
+            }
+            ptr += n;
+            size -= static_cast<std::size_t>(n);
+        }
+    }
+
+    void handle_connection(int fd) {
+        std::string request;
+        std::array<char, 512> data; // NOLINT(cppcoreguidelines-pro-type-member-init)
+        while (request.size() < max_request_size && request.find('\n') == std::string::npos) {
+            const auto n = ::read(fd, data.data(), data.size());
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            request.append(data.data(), static_cast<std::size_t>(n));
+        }
+
+        std::string response;
+        const auto eol = request.find('\n');
+        if (eol == std::string::npos) {
+            response = "ERROR incomplete request\n";
+        } else {
+            request.resize(eol);
+            try {
+                response = handle_request(request);
+            } catch (const std::exception& e) {
+                response = std::string{"ERROR "} + e.what() + "\n";
+            }
+            std::cerr << "Request '" << request << "': " << response;
+        }
+
+        write_all(fd, response);
+        ::close(fd);
+    }
+
+public:
+
+    ExportServer(std::string input_filename, std::string output_directory, std::string output_format, const osmium::area::Assembler::config_type& assembler_config, bool dictionary) :
+        m_input_filename(std::move(input_filename)),
+        m_output_directory(std::move(output_directory)),
+        m_output_format(std::move(output_format)),
+        m_assembler_config(assembler_config),
+        m_dictionary(dictionary),
+        m_mtime(std::filesystem::last_write_time(m_input_filename)),
+        m_snapshot(load()) {
+    }
+
+    /// Listen on the socket and serve requests. Never returns.
+    [[noreturn]] void run(const std::string& socket_path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error{"Socket path '" + socket_path + "' too long"};
+        }
+        std::copy(socket_path.begin(), socket_path.end(), address.sun_path);
+
+        const int listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd < 0) {
+            throw std::system_error{errno, std::system_category(), "Can not create socket"};
+        }
+        ::unlink(socket_path.c_str());
+
+        // Requests can write files with the privileges of the server, so
+        // only the user running it may connect. The umask makes sure the
+        // socket is never accessible to others, not even briefly.
+        const auto old_umask = ::umask(0077);
+        const int bind_result = ::bind(listen_fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+        ::umask(old_umask);
+        if (bind_result != 0 ||
+            ::chmod(socket_path.c_str(), 0600) != 0 ||
+            ::listen(listen_fd, 16) != 0) {
+            throw std::system_error{errno, std::system_category(), "Can not listen on socket '" + socket_path + "'"};
+        }
+
+        // Clients closing the connection early must not kill the server.
+        std::signal(SIGPIPE, SIG_IGN);
+
+        std::thread{[this]() {
+            watch_input();
+        }}.detach();
+
+        std::cerr << "Listening on '" << socket_path << "'\n";
+        while (true) {
+            const int fd = ::accept(listen_fd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                throw std::system_error{errno, std::system_category(), "Accepting connection failed"};
+            }
+
+            if (m_active_requests >= max_concurrent_requests) {
+                write_all(fd, "ERROR too many concurrent requests\n");
+                ::close(fd);
+                continue;
+            }
+
+            ++m_active_requests;
+            std::thread{[this, fd]() {
+                handle_connection(fd);
+                --m_active_requests;
+            }}.detach();
+        }
+    }
+
+}; // class ExportServer
+
+#endif
+
 /* ================================================== */
 
 void print_help() {
@@ -111,9 +769,22 @@ void print_help() {
               << "If INFILE is not given stdin is assumed.\n" \
               << "If OUTFILE is not given 'ogr_out' is used.\n" \
               << "\nOptions:\n" \
-              << "  -h, --help           This help message\n" \
-              << "  -d, --debug          Enable debug output\n" \
-              << "  -f, --format=FORMAT  Output OGR format (Default: 'SQLite')\n";
+              << "  -h, --help             This help message\n" \
+              << "  -d, --debug            Enable debug output\n" \
+              << "  -D, --dictionary       Write types as integer codes with lookup tables\n" \
+              << "  -f, --format=FORMAT    Output OGR format (Default: 'SQLite')\n" \
+              << "  -M, --memory-log=FILE  Write memory use of main data structures\n" \
+              << "                         every second to FILE\n" \
+              << "  -s, --serve=SOCKET     Keep INFILE in memory and serve export requests\n" \
+              << "                         on the unix domain socket SOCKET\n" \
+              << "\nServer mode: osmium_toogr2 [OPTIONS] --serve=SOCKET INFILE OUTDIR\n" \
+              << "Each connection sends one request line\n" \
+              << "  MINLON MINLAT MAXLON MAXLAT LAYERS OUTFILE [FORMAT]\n" \
+              << "LAYERS is 'all' or a comma separated list of 'postboxes', 'roads',\n" \
+              << "and 'buildings'. OUTFILE must be a file name without directory, it\n" \
+              << "is created in OUTDIR and must not exist yet. The answer is 'OK NUM'\n" \
+              << "or 'ERROR MESSAGE'. Only the user running the server can connect to\n" \
+              << "SOCKET. INFILE is reloaded when it changes.\n";
 }
 
 int main(int argc, char* argv[]) {
@@ -121,15 +792,21 @@ int main(int argc, char* argv[]) {
         static struct option long_options[] = {
             {"help",   no_argument, nullptr, 'h'},
             {"debug",  no_argument, nullptr, 'd'},
+            {"dictionary", no_argument, nullptr, 'D'},
             {"format", required_argument, nullptr, 'f'},
+            {"memory-log", required_argument, nullptr, 'M'},
+            {"serve", required_argument, nullptr, 's'},
             {nullptr, 0, nullptr, 0}
         };
 
         std::string output_format{"SQLite"};
         bool debug = false;
+        bool dictionary = false;
+        std::string memory_log_filename;
+        std::string socket_path;
 
         while (true) {
-            const int c = getopt_long(argc, argv, "hdf:", long_options, nullptr);
+            const int c = getopt_long(argc, argv, "hdDf:M:s:", long_options, nullptr);
             if (c == -1) {
                 break;
             }
@@ -141,9 +818,18 @@ int main(int argc, char* argv[]) {
                 case 'd':
                     debug = true;
                     break;
+                case 'D':
+                    dictionary = true;
+                    break;
                 case 'f':
                     output_format = optarg;
                     break;
+                case 'M':
+                    memory_log_filename = optarg;
+                    break;
+                case 's':
+                    socket_path = optarg;
+                    break;
                 default:
                     return 1;
             }
@@ -166,19 +852,63 @@ int main(int argc, char* argv[]) {
             input_filename = "-";
         }
 
-        const osmium::io::File input_file{input_filename};
-
         osmium::area::Assembler::config_type assembler_config;
         if (debug) {
             assembler_config.debug_level = 1;
         }
-        osmium::area::MultipolygonManager<osmium::area::Assembler> mp_manager{assembler_config};
+
+        if (!socket_path.empty()) {
+            if (remaining_args != 2 || !memory_log_filename.empty()) {
+                std::cerr << "Usage: " << argv[0] << " [OPTIONS] --serve=SOCKET INFILE OUTDIR\n";
+                return 1;
+            }
+            if (!std::filesystem::is_directory(output_filename)) {
+                std::cerr << "Output directory '" << output_filename << "' does not exist\n";
+                return 1;
+            }
+#ifndef _WIN32
+            CPLSetConfigOption("OGR_SQLITE_SYNCHRONOUS", "OFF");
+            ExportServer server{input_filename, output_filename, output_format, assembler_config, dictionary};
+            server.run(socket_path);
+#else
+            std::cerr << "Server mode is not supported on this platform\n";
+            return 1;
+#endif
+        }
+
+        const osmium::io::File input_file{input_filename};
+
+        // Areas from closed ways are created by the handler, which only
+        // needs the assembler if the way is not a simple ring.
+        osmium::area::Assembler::config_type mp_assembler_config{assembler_config};
+        mp_assembler_config.create_way_polygons = false;
+        osmium::area::MultipolygonManager<osmium::area::Assembler> mp_manager{mp_assembler_config};
+        AreaRelationMembers area_members;
+
+        index_type index;
+
+        MemoryAccounting memory_accounting{!memory_log_filename.empty(), memory_log_filename, std::chrono::seconds{1}};
+        memory_accounting.add_source("location_index", [&index]() {
+            return index.used_memory();
+        });
+        memory_accounting.add_source("mp_relations", [&mp_manager]() {
+            return mp_manager.used_memory().relations_db;
+        });
+        memory_accounting.add_source("mp_members", [&mp_manager]() {
+            return mp_manager.used_memory().members_db;
+        });
+        memory_accounting.add_source("mp_stash", [&mp_manager]() {
+            return mp_manager.used_memory().stash;
+        });
+        memory_accounting.add_source("area_members", [&area_members]() {
+            return area_members.used_memory();
+        });
 
         std::cerr << "Pass 1...\n";
-        osmium::relations::read_relations(input_file, mp_manager);
+        memory_accounting.start_phase("pass1");
+        osmium::relations::read_relations(input_file, mp_manager, area_members, memory_accounting.handler());
         std::cerr << "Pass 1 done\n";
 
-        index_type index;
         location_handler_type location_handler{index};
         location_handler.ignore_errors();
 
@@ -192,16 +922,19 @@ int main(int argc, char* argv[]) {
 
         CPLSetConfigOption("OGR_SQLITE_SYNCHRONOUS", "OFF");
         gdalcpp::Dataset dataset{output_format, output_filename, gdalcpp::SRS{factory.proj_string()}, { "SPATIALITE=TRUE", "INIT_WITH_EPSG=no" }};
-        MyOGRHandler<decltype(factory)::projection_type> ogr_handler{dataset, factory};
+        MyOGRHandler<decltype(factory)::projection_type> ogr_handler{dataset, factory, assembler_config, area_members, dictionary};
 
         std::cerr << "Pass 2...\n";
+        memory_accounting.start_phase("pass2");
         osmium::io::Reader reader{input_file};
 
         osmium::apply(reader, location_handler, ogr_handler, mp_manager.handler([&ogr_handler](const osmium::memory::Buffer& area_buffer) {
             osmium::apply(area_buffer, ogr_handler);
-        }));
+        }), memory_accounting.handler());
 
         reader.close();
+        memory_accounting.start_phase("finish");
+        ogr_handler.write_lookup_tables(dataset);
         std::cerr << "Pass 2 done\n";
 
         std::vector<osmium::object_id_type> incomplete_relations_ids;
@@ -216,6 +949,8 @@ int main(int argc, char* argv[]) {
             std::cerr << "\n";
         }
 
+        memory_accounting.print_summary(std::cerr);
+
         const osmium::MemoryUsage memory;
         if (memory.peak()) {
             std::cerr << "Memory used: " << memory.peak() << " MBytes\n";
@@ -0,0 +1,544 @@
+#ifndef OSM_GIS_EXPORT_OVERVIEW_HANDLER_HPP
+#define OSM_GIS_EXPORT_OVERVIEW_HANDLER_HPP
+
+#include "arrow_batch.hpp"
+#include "geometry_recycler.hpp"
+#include "simple_ring.hpp"
+#include "string_dictionary.hpp"
+#include "tiled_output.hpp"
+
+#include <gdalcpp.hpp>
+
+#include <osmium/area/assembler.hpp>
+#include <osmium/geom/factory.hpp>
+#include <osmium/geom/ogr.hpp>
+#include <osmium/handler.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/area.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/node.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/timestamp.hpp>
+#include <osmium/osm/way.hpp>
+#include <osmium/visitor.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct config {
+    bool add_untagged_nodes = false;
+    bool add_metadata = false;
+    bool add_routes = false;
+    bool dictionary = false;
+    std::vector<std::string> dictionary_keys; // sorted
+    bool verbose = false;
+    std::size_t arrow_batch_size = 0;
+    int tiles_zoom = -1;
+    bool clip_tiles = false;
+};
+
+/**
+ * Writes nodes, ways, areas, and (if enabled) routes to the points,
+ * lines, areas, and routes layers of the dataset.
+ */
+template <class TProjection>
+class MyOGRHandler : public osmium::handler::Handler {
+
+    static const std::size_t max_length_tags = 200;
+
+    struct feature_deleter {
+        void operator()(OGRFeature* feature) const noexcept {
+            OGRFeature::DestroyFeature(feature);
+        }
+    };
+
+    /**
+     * Everything needed to write features to one layer: The feature
+     * object and its geometry are reused for all features written to
+     * the layer, the field indexes are looked up once.
+     */
+    struct layer_writer {
+        gdalcpp::Layer* layer = nullptr;
+        std::unique_ptr<OGRFeature, feature_deleter> feature;
+#ifdef HAVE_ARROW_BATCHES
+        std::unique_ptr<ArrowBatch> batch;
+#endif
+        std::size_t tile_layer = 0;
+        std::unique_ptr<StringDictionary> dictionary;
+        int id = -1;
+        int tags = -1;
+        int tag_codes = -1;
+        int version = -1;
+        int changeset = -1;
+        int timestamp = -1;
+        int uid = -1;
+        int user = -1;
+    };
+
+    config m_cfg;
+
+    gdalcpp::Dataset& m_dataset;
+    gdalcpp::Layer m_layer_point;
+    gdalcpp::Layer m_layer_linestring;
+    gdalcpp::Layer m_layer_multipolygon;
+    std::unique_ptr<gdalcpp::Layer> m_layer_route;
+
+    layer_writer m_writer_point;
+    layer_writer m_writer_linestring;
+    layer_writer m_writer_multipolygon;
+    layer_writer m_writer_route;
+
+    TiledOutput* m_tiles;
+
+    osmium::geom::OGRFactory<TProjection>& m_factory;
+    TProjection m_projection;
+
+    osmium::area::Assembler::config_type m_assembler_config;
+    const AreaRelationMembers& m_area_members;
+    osmium::memory::Buffer m_area_buffer{10240, osmium::memory::Buffer::auto_grow::yes};
+
+    std::string m_tags;
+    std::string m_tag_codes;
+    std::string m_tag;
+
+    GeometryRecycler m_recycler;
+    std::vector<OGRRawPoint> m_points;
+
+    void add_metadata_fields(gdalcpp::Layer& layer) {
+        layer.add_field("version", OFTInteger, 7);
+        layer.add_field("changeset", OFTInteger, 7);
+        layer.add_field("timestamp", OFTDateTime, 20);
+        layer.add_field("uid", OFTInteger, 7);
+        layer.add_field("user", OFTString, 256);
+    }
+
+    void init_writer(layer_writer& writer, gdalcpp::Layer& layer, std::unique_ptr<OGRGeometry>&& geometry, const char* id_format) {
+        OGRFeatureDefn* defn = layer.get().GetLayerDefn();
+
+        writer.layer = &layer;
+        writer.feature.reset(OGRFeature::CreateFeature(defn));
+        if (!writer.feature) {
+            throw std::bad_alloc{};
+        }
+        writer.feature->SetGeometryDirectly(geometry.release());
+
+        if (m_cfg.dictionary) {
+            writer.dictionary = std::make_unique<StringDictionary>();
+        }
+
+        if (m_tiles) {
+            writer.tile_layer = m_tiles->add_layer(layer);
+        }
+
+        writer.id = defn->GetFieldIndex("id");
+        writer.tags = defn->GetFieldIndex("tags");
+        writer.tag_codes = defn->GetFieldIndex("tag_codes");
+        if (m_cfg.add_metadata) {
+            writer.version = defn->GetFieldIndex("version");
+            writer.changeset = defn->GetFieldIndex("changeset");
+            writer.timestamp = defn->GetFieldIndex("timestamp");
+            writer.uid = defn->GetFieldIndex("uid");
+            writer.user = defn->GetFieldIndex("user");
+        }
+
+        if (m_cfg.arrow_batch_size) {
+#ifdef HAVE_ARROW_BATCHES
+            writer.batch = create_batch(layer, id_format);
+#else
+            (void)id_format;
+            throw std::runtime_error{"Writing Arrow batches needs GDAL 3.8 or newer"};
+#endif
+        }
+    }
+
+    template <typename TGeometry>
+    static TGeometry& geometry(layer_writer& writer) {
+        return *static_cast<TGeometry*>(writer.feature->GetGeometryRef());
+    }
+
+    static void set_timestamp(OGRFeature& feature, int field, const osmium::Timestamp timestamp) {
+        if (!timestamp.valid()) {
+            feature.SetFieldNull(field);
+            return;
+        }
+
+        // Civil date from days since epoch, see
+        // https://howardhinnant.github.io/date_algorithms.html#civil_from_days
+        const auto seconds = static_cast<int64_t>(timestamp.seconds_since_epoch());
+        const int64_t z = seconds / 86400 + 719468;
+        const int64_t era = z / 146097;
+        const int64_t doe = z - era * 146097;
+        const int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        const int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        const int64_t mp = (5 * doy + 2) / 153;
+        const int64_t day = doy - (153 * mp + 2) / 5 + 1;
+        const int64_t month = mp < 10 ? mp + 3 : mp - 9;
+        const int64_t year = yoe + era * 400 + (month <= 2 ? 1 : 0);
+        const int64_t time = seconds % 86400;
+
+        feature.SetField(field,
+                         static_cast<int>(year),
+                         static_cast<int>(month),
+                         static_cast<int>(day),
+                         static_cast<int>(time / 3600),
+                         static_cast<int>((time / 60) % 60),
+                         static_cast<float>(time % 60),
+                         100); // UTC
+    }
+
+    bool is_dictionary_key(const char* key) const {
+        return std::binary_search(m_cfg.dictionary_keys.begin(), m_cfg.dictionary_keys.end(), key,
+                                  [](const auto& a, const auto& b) {
+            return std::string_view{a} < std::string_view{b};
+        });
+    }
+
+    /**
+     * Build the content of the tags field, a comma-separated list of
+     * key=value pairs, in m_tags. If the writer has a dictionary, tags
+     * with one of the dictionary keys are left out of m_tags, their codes
+     * are put into m_tag_codes instead.
+     *
+     * The codes are written as comma-separated text, not as OFTIntegerList:
+     * SQLite and GeoPackage store integer lists as text anyway and other
+     * formats like Shapefile don't have them at all.
+     */
+    void build_tags(const layer_writer& writer, const osmium::OSMObject& object) {
+        m_tags.clear();
+        m_tag_codes.clear();
+        for (const auto& tag : object.tags()) {
+            if (writer.dictionary && is_dictionary_key(tag.key())) {
+                m_tag.clear();
+                m_tag += tag.key();
+                m_tag += '=';
+                m_tag += tag.value();
+                std::array<char, 16> code{};
+                const auto result = std::to_chars(code.data(), code.data() + code.size(), writer.dictionary->code(m_tag));
+                m_tag_codes.append(code.data(), result.ptr);
+                m_tag_codes += ',';
+            } else {
+                m_tags += tag.key();
+                m_tags += '=';
+                m_tags += tag.value();
+                m_tags += ',';
+            }
+        }
+        if (!m_tags.empty()) {
+            m_tags.pop_back();
+        }
+        if (!m_tag_codes.empty()) {
+            m_tag_codes.pop_back();
+        }
+    }
+
+    // Write feature with the geometry currently set on the writer.
+    template <typename TId>
+    void write(layer_writer& writer, TId id, const osmium::OSMObject& object) {
+#ifdef HAVE_ARROW_BATCHES
+        if (writer.batch) {
+            writer.batch->append(id);
+            add_to_batch(writer, object);
+            return;
+        }
+#endif
+        OGRFeature& feature = *writer.feature;
+        feature.SetFID(OGRNullFID);
+        feature.SetField(writer.id, id);
+        build_tags(writer, object);
+        feature.SetField(writer.tags, m_tags.c_str());
+        if (writer.dictionary) {
+            feature.SetField(writer.tag_codes, m_tag_codes.c_str());
+        }
+        if (m_cfg.add_metadata) {
+            feature.SetField(writer.version, int32_t(object.version()));
+            feature.SetField(writer.changeset, int32_t(object.changeset()));
+            set_timestamp(feature, writer.timestamp, object.timestamp());
+            feature.SetField(writer.uid, int32_t(object.uid()));
+            feature.SetField(writer.user, object.user());
+        }
+        if (m_tiles) {
+            m_tiles->add(writer.tile_layer, feature);
+            return;
+        }
+        writer.layer->create_feature(&feature);
+    }
+
+    // Same as OGRFactory::create_linestring(), but reusing the linestring.
+    void set_linestring(OGRLineString& linestring, const osmium::Way& way) {
+        int num_points = 0;
+        osmium::Location last_location;
+        for (const auto& node_ref : way.nodes()) {
+            if (node_ref.location() != last_location) {
+                last_location = node_ref.location();
+                ++num_points;
+            }
+        }
+
+        if (num_points < 2) {
+            throw osmium::geometry_error{"need at least two points for linestring", "way", way.id()};
+        }
+
+        linestring.setNumPoints(num_points, FALSE);
+        int n = 0;
+        last_location = osmium::Location{};
+        for (const auto& node_ref : way.nodes()) {
+            if (node_ref.location() != last_location) {
+                last_location = node_ref.location();
+                const auto coordinates = m_projection(last_location);
+                linestring.setPoint(n++, coordinates.x, coordinates.y);
+            }
+        }
+    }
+
+    // Projected locations of the ring with consecutive duplicates removed.
+    const std::vector<OGRRawPoint>& ring_points(const osmium::NodeRefList& ring) {
+        m_points.clear();
+        osmium::Location last_location;
+        for (const auto& node_ref : ring) {
+            if (node_ref.location() != last_location) {
+                last_location = node_ref.location();
+                const auto coordinates = m_projection(last_location);
+                m_points.emplace_back(coordinates.x, coordinates.y);
+            }
+        }
+        return m_points;
+    }
+
+    // Same as OGRFactory::create_multipolygon(), but reusing the
+    // multipolygon and its parts.
+    void set_multipolygon(OGRMultiPolygon& multipolygon, const osmium::Area& area) {
+        m_recycler.clear(multipolygon);
+        for (const auto& outer_ring : area.outer_rings()) {
+            auto& polygon = m_recycler.add_polygon(multipolygon);
+            m_recycler.add_ring(polygon, ring_points(outer_ring));
+            for (const auto& inner_ring : area.inner_rings(outer_ring)) {
+                m_recycler.add_ring(polygon, ring_points(inner_ring));
+            }
+        }
+
+        if (multipolygon.IsEmpty()) {
+            throw osmium::geometry_error{"invalid area", "area", area.id()};
+        }
+    }
+
+#ifdef HAVE_ARROW_BATCHES
+    std::unique_ptr<ArrowBatch> create_batch(gdalcpp::Layer& layer, const char* id_format) {
+        auto batch = std::make_unique<ArrowBatch>(m_dataset, layer, m_cfg.arrow_batch_size);
+        batch->add_column("id", id_format);
+        batch->add_column("tags", "U");
+        if (m_cfg.dictionary) {
+            batch->add_column("tag_codes", "U");
+        }
+        if (m_cfg.add_metadata) {
+            batch->add_column("version", "i");
+            batch->add_column("changeset", "i");
+            batch->add_column("timestamp", "tss:UTC");
+            batch->add_column("uid", "i");
+            batch->add_column("user", "U");
+        }
+        batch->add_geometry_column();
+        return batch;
+    }
+
+    // The id has to be appended by the caller because its type differs
+    // between layers.
+    void add_to_batch(layer_writer& writer, const osmium::OSMObject& object) {
+        ArrowBatch& batch = *writer.batch;
+        build_tags(writer, object);
+        batch.append(m_tags);
+        if (writer.dictionary) {
+            batch.append(m_tag_codes);
+        }
+        if (m_cfg.add_metadata) {
+            batch.append(int32_t(object.version()));
+            batch.append(int32_t(object.changeset()));
+            // Invalid timestamps are null like in set_timestamp().
+            if (object.timestamp().valid()) {
+                batch.append(static_cast<int64_t>(object.timestamp().seconds_since_epoch()));
+            } else {
+                batch.append_null<int64_t>();
+            }
+            batch.append(int32_t(object.uid()));
+            batch.append(object.user());
+        }
+        batch.append_geometry(*writer.feature->GetGeometryRef());
+        batch.commit_row();
+    }
+#endif
+
+public:
+
+    MyOGRHandler(gdalcpp::Dataset& dataset, osmium::geom::OGRFactory<TProjection>& factory, const config& cfg, const osmium::area::Assembler::config_type& assembler_config, const AreaRelationMembers& area_members, TiledOutput* tiles = nullptr) :
+        m_cfg(cfg),
+        m_dataset(dataset),
+        m_layer_point(dataset, "points", wkbPoint, {"SPATIAL_INDEX=NO"}),
+        m_layer_linestring(dataset, "lines", wkbLineString, {"SPATIAL_INDEX=NO"}),
+        m_layer_multipolygon(dataset, "areas", wkbMultiPolygon, {"SPATIAL_INDEX=NO"}),
+        m_tiles(tiles),
+        m_factory(factory),
+        m_assembler_config(assembler_config),
+        m_area_members(area_members) {
+
+        m_layer_point.add_field("id", OFTReal, 10);
+        m_layer_linestring.add_field("id", OFTInteger, 7);
+        m_layer_multipolygon.add_field("id", OFTInteger, 7);
+
+        m_layer_point.add_field("tags", OFTString, max_length_tags);
+        m_layer_linestring.add_field("tags", OFTString, max_length_tags);
+        m_layer_multipolygon.add_field("tags", OFTString, max_length_tags);
+
+        if (m_cfg.dictionary) {
+            m_layer_point.add_field("tag_codes", OFTString, max_length_tags);
+            m_layer_linestring.add_field("tag_codes", OFTString, max_length_tags);
+            m_layer_multipolygon.add_field("tag_codes", OFTString, max_length_tags);
+        }
+
+        if (m_cfg.add_metadata) {
+            add_metadata_fields(m_layer_point);
+            add_metadata_fields(m_layer_linestring);
+            add_metadata_fields(m_layer_multipolygon);
+        }
+
+        init_writer(m_writer_point, m_layer_point, std::make_unique<OGRPoint>(), "g");
+        init_writer(m_writer_linestring, m_layer_linestring, std::make_unique<OGRLineString>(), "i");
+        init_writer(m_writer_multipolygon, m_layer_multipolygon, std::make_unique<OGRMultiPolygon>(), "i");
+
+        if (m_cfg.add_routes) {
+            m_layer_route = std::make_unique<gdalcpp::Layer>(dataset, "routes", wkbMultiLineString, std::vector<std::string>{"SPATIAL_INDEX=NO"});
+            m_layer_route->add_field("id", OFTInteger, 7);
+            m_layer_route->add_field("tags", OFTString, max_length_tags);
+            if (m_cfg.dictionary) {
+                m_layer_route->add_field("tag_codes", OFTString, max_length_tags);
+            }
+            if (m_cfg.add_metadata) {
+                add_metadata_fields(*m_layer_route);
+            }
+            init_writer(m_writer_route, *m_layer_route, std::make_unique<OGRMultiLineString>(), "i");
+        }
+    }
+
+    void node(const osmium::Node& node) {
+        if (m_cfg.add_untagged_nodes || !node.tags().empty()) {
+            const auto coordinates = m_projection(node.location());
+            auto& point = geometry<OGRPoint>(m_writer_point);
+            point.setX(coordinates.x);
+            point.setY(coordinates.y);
+            write(m_writer_point, double(node.id()), node);
+        }
+    }
+
+    void way(const osmium::Way& way) {
+        try {
+            set_linestring(geometry<OGRLineString>(m_writer_linestring), way);
+            write(m_writer_linestring, int32_t(way.id()), way);
+        } catch (const osmium::geometry_error&) {
+            std::cerr << "Ignoring illegal geometry for way " << way.id() << ".\n";
+        }
+
+        way_area(way);
+    }
+
+    /**
+     * Create area from closed way. The MultipolygonManager is configured
+     * not to do this, so that simple rings can be written directly. Only
+     * if that isn't possible the assembler is used.
+     */
+    void way_area(const osmium::Way& way) {
+        if (!is_area_way(way, m_area_members)) {
+            return;
+        }
+
+        const int orientation = simple_ring_orientation(way.nodes());
+        if (orientation != 0) {
+            // All locations are valid and different, so this can't fail.
+            // Outer rings are written counter-clockwise like the
+            // assembler does.
+            ring_points(way.nodes());
+            if (orientation < 0) {
+                std::reverse(m_points.begin(), m_points.end());
+            }
+            auto& multipolygon = geometry<OGRMultiPolygon>(m_writer_multipolygon);
+            m_recycler.clear(multipolygon);
+            m_recycler.add_ring(m_recycler.add_polygon(multipolygon), m_points);
+            write(m_writer_multipolygon, int32_t(osmium::object_id_to_area_id(way.id(), osmium::item_type::way)), way);
+            return;
+        }
+
+        // The assembler keeps state for one area only, so it can't be
+        // reused. This path is only taken for closed ways that are not
+        // simple rings.
+        try {
+            osmium::area::Assembler assembler{m_assembler_config};
+            assembler(way, m_area_buffer);
+            osmium::apply(m_area_buffer, *this);
+        } catch (const osmium::invalid_location&) {
+            // ignore like the MultipolygonManager does
+        }
+        m_area_buffer.clear();
+    }
+
+    void area(const osmium::Area& area) {
+        try {
+            set_multipolygon(geometry<OGRMultiPolygon>(m_writer_multipolygon), area);
+            write(m_writer_multipolygon, int32_t(area.id()), area);
+        } catch (const osmium::geometry_error&) {
+            std::cerr << "Ignoring illegal geometry for area "
+                        << area.id()
+                        << " created from "
+                        << (area.from_way() ? "way" : "relation")
+                        << " with id="
+                        << area.orig_id() << ".\n";
+        }
+    }
+
+    template <typename TRouteManager>
+    void route(const osmium::Relation& relation, const TRouteManager& route_manager) {
+        assert(m_layer_route);
+        auto& multilinestring = geometry<OGRMultiLineString>(m_writer_route);
+        m_recycler.clear(multilinestring);
+        route_manager.for_each_member_linestring(relation, [&](const std::vector<OGRRawPoint>& points) {
+            m_recycler.add_linestring(multilinestring, points);
+        });
+        if (!multilinestring.IsEmpty()) {
+            write(m_writer_route, int32_t(relation.id()), relation);
+        }
+    }
+
+    /**
+     * Write out features still held in batches or tiles and the lookup
+     * tables for dictionary encoded tags. Call once before closing the
+     * dataset. (This must not be called flush(), osmium::apply() calls
+     * that on all handlers after every buffer.)
+     */
+    void finish() {
+        if (m_tiles) {
+            m_tiles->close();
+        }
+#ifdef HAVE_ARROW_BATCHES
+        for (auto* writer : {&m_writer_point, &m_writer_linestring, &m_writer_multipolygon, &m_writer_route}) {
+            if (writer->batch) {
+                writer->batch->flush();
+            }
+        }
+#endif
+        for (auto* writer : {&m_writer_point, &m_writer_linestring, &m_writer_multipolygon, &m_writer_route}) {
+            if (writer->dictionary) {
+                writer->dictionary->write(m_dataset, std::string{writer->layer->get().GetName()} + "_tags");
+            }
+        }
+    }
+
+};
+
+#endif // OSM_GIS_EXPORT_OVERVIEW_HANDLER_HPP
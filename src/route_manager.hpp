@@ -0,0 +1,257 @@
+#ifndef OSM_GIS_EXPORT_ROUTE_MANAGER_HPP
+#define OSM_GIS_EXPORT_ROUTE_MANAGER_HPP
+
+#include <gdalcpp.hpp>
+
+#include <protozero/varint.hpp>
+
+#include <osmium/handler.hpp>
+#include <osmium/memory/buffer.hpp>
+#include <osmium/osm/location.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/way.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * Assembles bus, hiking and road route relations into multilinestrings
+ * with one linestring per member way.
+ *
+ * Use it like the MultipolygonManager: as a manager in
+ * osmium::relations::read_relations() in the first pass and through
+ * handler() in the second pass after the location handler.
+ *
+ * While a route is waiting for its members, the geometries of the member
+ * ways seen so far are kept as zigzag/varint encoded coordinate deltas,
+ * a few bytes per node. A way geometry is dropped as soon as all routes
+ * it is a member of have been completed.
+ *
+ * The callback for a completed route gets the relation and the manager.
+ * It can get the geometry through for_each_member_linestring() and build
+ * it into whatever geometry object it wants to reuse.
+ */
+template <class TProjection>
+class RouteManager : public osmium::handler::Handler {
+
+public:
+
+    using callback_type = std::function<void(const osmium::Relation&, const RouteManager&)>;
+
+private:
+
+    struct route {
+        std::size_t offset; // of the relation in m_relations
+        std::size_t missing_members;
+    };
+
+    struct way_geometry {
+        std::string data;
+        std::size_t references;
+    };
+
+    osmium::memory::Buffer m_relations{1024 * 1024, osmium::memory::Buffer::auto_grow::yes};
+    std::vector<route> m_routes;
+
+    // (way id, index into m_routes), sorted after the first pass
+    std::vector<std::pair<osmium::object_id_type, std::size_t>> m_members;
+
+    std::unordered_map<osmium::object_id_type, way_geometry> m_way_geometries;
+
+    // Approximate bytes used by the entries of m_way_geometries
+    std::size_t m_way_geometries_size = 0;
+
+    TProjection m_projection;
+    callback_type m_callback;
+
+    // Scratch space for for_each_member_linestring()
+    mutable std::vector<OGRRawPoint> m_points;
+
+    static std::size_t way_geometry_size(const way_geometry& geometry) noexcept {
+        return sizeof(std::pair<const osmium::object_id_type, way_geometry>) + geometry.data.capacity();
+    }
+
+    static bool is_wanted_route(const osmium::Relation& relation) {
+        if (!relation.tags().has_tag("type", "route")) {
+            return false;
+        }
+        const char* route = relation.tags()["route"];
+        return route && (!std::strcmp(route, "bus") ||
+                         !std::strcmp(route, "hiking") ||
+                         !std::strcmp(route, "road"));
+    }
+
+    static std::string encode(const osmium::WayNodeList& nodes) {
+        std::string data;
+        int64_t x = 0;
+        int64_t y = 0;
+        bool first = true;
+        for (const auto& node_ref : nodes) {
+            const auto location = node_ref.location();
+            if (!location.valid() || (!first && location.x() == x && location.y() == y)) {
+                continue;
+            }
+            first = false;
+            protozero::add_varint_to_buffer(&data, protozero::encode_zigzag64(location.x() - x));
+            protozero::add_varint_to_buffer(&data, protozero::encode_zigzag64(location.y() - y));
+            x = location.x();
+            y = location.y();
+        }
+        return data;
+    }
+
+    void decode(const std::string& data, std::vector<OGRRawPoint>& points) const {
+        points.clear();
+        const char* it = data.data();
+        const char* const end = data.data() + data.size();
+        int64_t x = 0;
+        int64_t y = 0;
+        while (it != end) {
+            x += protozero::decode_zigzag64(protozero::decode_varint(&it, end));
+            y += protozero::decode_zigzag64(protozero::decode_varint(&it, end));
+            const auto coordinates = m_projection(osmium::Location{static_cast<int32_t>(x), static_cast<int32_t>(y)});
+            points.emplace_back(coordinates.x, coordinates.y);
+        }
+    }
+
+    void complete_route(const route& r) {
+        const auto& relation = m_relations.get<osmium::Relation>(r.offset);
+
+        if (m_callback) {
+            m_callback(relation, *this);
+        }
+
+        for (const auto& member : relation.members()) {
+            if (member.type() != osmium::item_type::way) {
+                continue;
+            }
+            const auto it = m_way_geometries.find(member.ref());
+            assert(it != m_way_geometries.end());
+            if (--it->second.references == 0) {
+                m_way_geometries_size -= way_geometry_size(it->second);
+                m_way_geometries.erase(it);
+            }
+        }
+    }
+
+public:
+
+    void relation(const osmium::Relation& relation) {
+        if (!is_wanted_route(relation)) {
+            return;
+        }
+
+        const std::size_t index = m_routes.size();
+        std::size_t missing_members = 0;
+        for (const auto& member : relation.members()) {
+            if (member.type() == osmium::item_type::way) {
+                m_members.emplace_back(member.ref(), index);
+                ++missing_members;
+            }
+        }
+
+        if (missing_members > 0) {
+            const auto offset = m_relations.committed();
+            m_relations.add_item(relation);
+            m_relations.commit();
+            m_routes.push_back(route{offset, missing_members});
+        }
+    }
+
+    void prepare_for_lookup() {
+        std::sort(m_members.begin(), m_members.end());
+    }
+
+    class SecondPassHandler : public osmium::handler::Handler {
+
+        RouteManager& m_manager;
+
+    public:
+
+        explicit SecondPassHandler(RouteManager& manager) noexcept :
+            m_manager(manager) {
+        }
+
+        void way(const osmium::Way& way) {
+            m_manager.handle_way(way);
+        }
+
+    }; // class SecondPassHandler
+
+    /// Set the callback for completed routes and return the handler for the second pass.
+    SecondPassHandler handler(callback_type callback) {
+        m_callback = std::move(callback);
+        return SecondPassHandler{*this};
+    }
+
+    void handle_way(const osmium::Way& way) {
+        const auto range = std::equal_range(m_members.begin(), m_members.end(),
+                                            std::make_pair(way.id(), std::size_t{0}),
+                                            [](const auto& a, const auto& b) {
+            return a.first < b.first;
+        });
+        if (range.first == range.second) {
+            return;
+        }
+
+        const auto& geometry = m_way_geometries[way.id()] = way_geometry{encode(way.nodes()),
+                                                                          static_cast<std::size_t>(range.second - range.first)};
+        m_way_geometries_size += way_geometry_size(geometry);
+
+        for (auto it = range.first; it != range.second; ++it) {
+            auto& r = m_routes[it->second];
+            if (--r.missing_members == 0) {
+                complete_route(r);
+            }
+        }
+    }
+
+    /// Approximate number of bytes used by buffered relations and way geometries.
+    std::size_t used_memory() const noexcept {
+        return m_relations.capacity() +
+               m_routes.capacity() * sizeof(route) +
+               m_members.capacity() * sizeof(decltype(m_members)::value_type) +
+               m_way_geometries.bucket_count() * sizeof(void*) +
+               m_way_geometries_size;
+    }
+
+    /**
+     * Call func with the (projected) points of each member way of the
+     * relation that has at least two points. Only valid for a completed
+     * route inside the callback. The points are only valid inside func.
+     */
+    template <typename TFunc>
+    void for_each_member_linestring(const osmium::Relation& relation, TFunc&& func) const {
+        for (const auto& member : relation.members()) {
+            if (member.type() != osmium::item_type::way) {
+                continue;
+            }
+            const auto it = m_way_geometries.find(member.ref());
+            assert(it != m_way_geometries.end());
+            decode(it->second.data, m_points);
+            if (m_points.size() > 1) {
+                func(m_points);
+            }
+        }
+    }
+
+    template <typename TFunc>
+    void for_each_incomplete_route(TFunc&& func) const {
+        for (const auto& r : m_routes) {
+            if (r.missing_members > 0) {
+                std::forward<TFunc>(func)(m_relations.get<osmium::Relation>(r.offset));
+            }
+        }
+    }
+
+}; // class RouteManager
+
+#endif // OSM_GIS_EXPORT_ROUTE_MANAGER_HPP
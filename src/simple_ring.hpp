@@ -0,0 +1,190 @@
+#ifndef OSM_GIS_EXPORT_SIMPLE_RING_HPP
+#define OSM_GIS_EXPORT_SIMPLE_RING_HPP
+
+/*
+
+  Helpers for writing closed ways as polygons directly instead of going
+  through the area assembler. Used by the export tools that turn off
+  create_way_polygons in the MultipolygonManager.
+
+*/
+
+#include <osmium/handler.hpp>
+#include <osmium/osm/relation.hpp>
+#include <osmium/osm/way.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+/**
+ * Collects the ids of the member ways of all multipolygon and boundary
+ * relations. The MultipolygonManager never creates an area from a closed
+ * way that is a member of such a relation, the relation area covers it.
+ *
+ * Use it as an additional manager in osmium::relations::read_relations()
+ * in the first pass.
+ */
+class AreaRelationMembers : public osmium::handler::Handler {
+
+    std::vector<osmium::object_id_type> m_ways;
+
+public:
+
+    void relation(const osmium::Relation& relation) {
+        const char* type = relation.tags()["type"];
+        if (!type || (std::strcmp(type, "multipolygon") && std::strcmp(type, "boundary"))) {
+            return;
+        }
+        for (const auto& member : relation.members()) {
+            if (member.type() == osmium::item_type::way) {
+                m_ways.push_back(member.ref());
+            }
+        }
+    }
+
+    void prepare_for_lookup() {
+        std::sort(m_ways.begin(), m_ways.end());
+        m_ways.erase(std::unique(m_ways.begin(), m_ways.end()), m_ways.end());
+        m_ways.shrink_to_fit();
+    }
+
+    bool is_member(osmium::object_id_type way_id) const noexcept {
+        return std::binary_search(m_ways.begin(), m_ways.end(), way_id);
+    }
+
+    std::size_t used_memory() const noexcept {
+        return m_ways.capacity() * sizeof(osmium::object_id_type);
+    }
+
+}; // class AreaRelationMembers
+
+/**
+ * Same checks the MultipolygonManager (with its default tags filter)
+ * does before it creates an area from a closed way: At least four nodes,
+ * valid and equal locations at both ends, some tags, no area=no, and not
+ * a member of a multipolygon or boundary relation.
+ */
+inline bool is_area_way(const osmium::Way& way, const AreaRelationMembers& members) {
+    return way.nodes().size() > 3 &&
+           way.nodes().front().location() &&
+           way.nodes().back().location() &&
+           way.ends_have_same_location() &&
+           !way.tags().empty() &&
+           !way.tags().has_tag("area", "no") &&
+           !members.is_member(way.id());
+}
+
+/**
+ * Cheap check whether a closed way is a simple polygon ring that can be
+ * written out directly instead of going through the area assembler: at
+ * most max_nodes nodes, all locations valid and different, and no two
+ * segments touching except neighbouring segments at their common node.
+ *
+ * Returns 1 if the ring is simple and oriented counter-clockwise, -1 if
+ * it is simple and oriented clockwise, and 0 if the check is
+ * inconclusive and the assembler has to be used.
+ */
+inline int simple_ring_orientation(const osmium::WayNodeList& nodes) {
+    constexpr const std::size_t max_nodes = 32;
+
+    // Keeps all products below in range of int64_t.
+    constexpr const int64_t max_extent = 1 << 28;
+
+    struct point {
+        int64_t x;
+        int64_t y;
+    };
+
+    const std::size_t size = nodes.size();
+    if (size < 4 || size > max_nodes || !nodes.is_closed()) {
+        return 0;
+    }
+
+    const auto origin = nodes.front().location();
+    if (!origin.valid()) {
+        return 0;
+    }
+
+    // Work on coordinates relative to the first node.
+    std::array<point, max_nodes> points; // NOLINT(cppcoreguidelines-pro-type-member-init)
+    for (std::size_t i = 0; i < size; ++i) {
+        const auto location = nodes[i].location();
+        if (!location.valid()) {
+            return 0;
+        }
+        points[i] = point{static_cast<int64_t>(location.x()) - origin.x(),
+                          static_cast<int64_t>(location.y()) - origin.y()};
+        if (std::abs(points[i].x) > max_extent || std::abs(points[i].y) > max_extent) {
+            return 0;
+        }
+    }
+
+    const std::size_t num_points = size - 1; // without the closing node
+
+    for (std::size_t i = 0; i < num_points; ++i) {
+        for (std::size_t j = i + 1; j < num_points; ++j) {
+            if (points[i].x == points[j].x && points[i].y == points[j].y) {
+                return 0;
+            }
+        }
+    }
+
+    const auto cross = [](const point& o, const point& a, const point& b) {
+        const int64_t c = (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+        return (c > 0) - (c < 0);
+    };
+
+    const auto within = [](const point& a, const point& b, const point& p) {
+        return std::min(a.x, b.x) <= p.x && p.x <= std::max(a.x, b.x) &&
+               std::min(a.y, b.y) <= p.y && p.y <= std::max(a.y, b.y);
+    };
+
+    const auto touch = [&](const point& a, const point& b, const point& c, const point& d) {
+        const int d1 = cross(c, d, a);
+        const int d2 = cross(c, d, b);
+        const int d3 = cross(a, b, c);
+        const int d4 = cross(a, b, d);
+        if (d1 * d2 < 0 && d3 * d4 < 0) {
+            return true;
+        }
+        return (d1 == 0 && within(c, d, a)) ||
+               (d2 == 0 && within(c, d, b)) ||
+               (d3 == 0 && within(a, b, c)) ||
+               (d4 == 0 && within(a, b, d));
+    };
+
+    for (std::size_t i = 0; i < num_points; ++i) {
+        const point& a = points[i];
+        const point& b = points[i + 1];
+
+        // Neighbouring segments only share a node, but they must not
+        // fold back onto each other.
+        const point& c = points[(i + 2) % num_points];
+        if (cross(a, b, c) == 0 && !within(a, c, b)) {
+            return 0;
+        }
+
+        for (std::size_t j = i + 2; j < num_points; ++j) {
+            if (i == 0 && j == num_points - 1) {
+                continue; // first and last segment are neighbours
+            }
+            if (touch(a, b, points[j], points[j + 1])) {
+                return 0;
+            }
+        }
+    }
+
+    int64_t sum = 0;
+    for (std::size_t i = 0; i < num_points; ++i) {
+        sum += points[i].x * points[i + 1].y - points[i + 1].x * points[i].y;
+    }
+
+    return (sum > 0) - (sum < 0);
+}
+
+#endif // OSM_GIS_EXPORT_SIMPLE_RING_HPP
@@ -0,0 +1,55 @@
+#ifndef OSM_GIS_EXPORT_STRING_DICTIONARY_HPP
+#define OSM_GIS_EXPORT_STRING_DICTIONARY_HPP
+
+#include <gdalcpp.hpp>
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/**
+ * Interns strings and assigns them consecutive integer codes starting at
+ * 0. Used to write low-cardinality attributes as small integer codes plus
+ * a lookup table.
+ */
+class StringDictionary {
+
+    // A deque never moves its elements, so the string_views used as keys
+    // in m_codes stay valid.
+    std::deque<std::string> m_values;
+    std::unordered_map<std::string_view, int32_t> m_codes;
+
+public:
+
+    int32_t code(std::string_view value) {
+        const auto it = m_codes.find(value);
+        if (it != m_codes.end()) {
+            return it->second;
+        }
+        const auto code = static_cast<int32_t>(m_values.size());
+        m_values.emplace_back(value);
+        m_codes.emplace(m_values.back(), code);
+        return code;
+    }
+
+    /// Write lookup table as non-spatial layer with "code" and "value" fields.
+    void write(gdalcpp::Dataset& dataset, const std::string& layer_name) const {
+        gdalcpp::Layer layer{dataset, layer_name, wkbNone};
+        layer.add_field("code", OFTInteger, 10);
+        layer.add_field("value", OFTString, 256);
+
+        int32_t code = 0;
+        for (const auto& value : m_values) {
+            gdalcpp::Feature feature{layer, std::unique_ptr<OGRGeometry>{}};
+            feature.set_field("code", code++);
+            feature.set_field("value", value.c_str());
+            feature.add_to_layer();
+        }
+    }
+
+}; // class StringDictionary
+
+#endif // OSM_GIS_EXPORT_STRING_DICTIONARY_HPP
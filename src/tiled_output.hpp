@@ -0,0 +1,368 @@
+#ifndef OSM_GIS_EXPORT_TILED_OUTPUT_HPP
+#define OSM_GIS_EXPORT_TILED_OUTPUT_HPP
+
+#include <gdalcpp.hpp>
+
+#include <osmium/geom/util.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/**
+ * Writes features into one dataset per tile of a fixed zoom level instead
+ * of a single dataset. Coordinates must be WGS84, tiles are the usual web
+ * mercator tiles. The datasets are written to DIRECTORY/Z/X/Y.EXT.
+ *
+ * Each feature is added to all tiles its bounding box overlaps, optionally
+ * clipped to the tile boundaries. Without clipping all tiles share one
+ * copy of the feature. Features are buffered in memory and flushed tile
+ * by tile when the buffer reaches max_buffered_bytes. At most max_open_tiles
+ * datasets are kept open at the same time, the least recently used one is
+ * closed when another one is needed and reopened for update later.
+ */
+class TiledOutput {
+
+    static constexpr const std::size_t max_buffered_bytes = 512UL * 1024UL * 1024UL;
+
+    // Rough estimate for a feature without geometry, fields included.
+    static constexpr const std::size_t feature_overhead = 256;
+    static constexpr const std::size_t max_open_tiles = 64;
+
+    // Web mercator can't show anything beyond this.
+    static constexpr const double max_latitude = 85.0511287798;
+
+    struct dataset_closer {
+        void operator()(GDALDataset* dataset) const noexcept {
+            GDALClose(dataset);
+        }
+    };
+
+    struct feature_deleter {
+        void operator()(OGRFeature* feature) const noexcept {
+            OGRFeature::DestroyFeature(feature);
+        }
+    };
+
+    using feature_ptr = std::unique_ptr<OGRFeature, feature_deleter>;
+    using buffer_entry = std::pair<std::size_t, std::shared_ptr<const OGRFeature>>;
+
+    struct tile_dataset {
+        std::unique_ptr<GDALDataset, dataset_closer> dataset;
+        std::vector<OGRLayer*> layers;
+        uint64_t last_use = 0;
+    };
+
+    std::string m_directory;
+    std::string m_format;
+    std::string m_extension;
+    std::vector<std::string> m_dataset_options;
+    uint32_t m_zoom;
+    bool m_clip;
+
+    std::vector<gdalcpp::Layer*> m_layers;
+
+    // Buffered features by tile. The key is (x << 32 | y), so
+    // flushing them in map order gives some locality.
+    std::map<uint64_t, std::vector<buffer_entry>> m_buffers;
+    std::size_t m_buffered_bytes = 0;
+
+    std::unordered_map<uint64_t, tile_dataset> m_open_tiles;
+    std::unordered_set<uint64_t> m_created_tiles;
+    uint64_t m_use_counter = 0;
+
+    uint32_t num_tiles() const noexcept {
+        return 1U << m_zoom;
+    }
+
+    uint32_t clamp_tile(double value) const noexcept {
+        if (value < 0.0) {
+            return 0;
+        }
+        const auto tile = static_cast<uint32_t>(value);
+        return tile < num_tiles() ? tile : num_tiles() - 1;
+    }
+
+    uint32_t lon_to_tile_x(double lon) const noexcept {
+        return clamp_tile((lon + 180.0) / 360.0 * num_tiles());
+    }
+
+    uint32_t lat_to_tile_y(double lat) const noexcept {
+        lat = std::max(-max_latitude, std::min(max_latitude, lat));
+        return clamp_tile((1.0 - std::asinh(std::tan(osmium::geom::deg_to_rad(lat))) / osmium::geom::PI) / 2.0 * num_tiles());
+    }
+
+    double tile_x_to_lon(uint32_t x) const noexcept {
+        return static_cast<double>(x) / num_tiles() * 360.0 - 180.0;
+    }
+
+    double tile_y_to_lat(uint32_t y) const noexcept {
+        return osmium::geom::rad_to_deg(std::atan(std::sinh(osmium::geom::PI * (1.0 - 2.0 * static_cast<double>(y) / num_tiles()))));
+    }
+
+    static uint64_t tile_key(uint32_t x, uint32_t y) noexcept {
+        return (static_cast<uint64_t>(x) << 32U) | y;
+    }
+
+    OGRwkbGeometryType tile_geometry_type(std::size_t layer) const {
+        const auto type = m_layers[layer]->get().GetGeomType();
+        // Clipping can split lines and polygons into several parts.
+        if (m_clip && type != wkbPoint) {
+            return OGR_GT_GetCollection(type);
+        }
+        return type;
+    }
+
+    static std::size_t feature_size(const OGRFeature& feature) {
+        const OGRGeometry* geometry = feature.GetGeometryRef();
+        return feature_overhead + (geometry ? static_cast<std::size_t>(geometry->WkbSize()) : 0);
+    }
+
+    // Add all parts of the geometry with the dimension of the collection
+    // to the collection. Intersection() can return a collection of parts
+    // with different dimensions, for instance a polygon and a line where
+    // the geometry touches the tile boundary. forceTo() leaves those
+    // unchanged, so the parts are picked out here.
+    static void add_parts(OGRGeometryCollection& collection, const OGRGeometry& geometry) {
+        if (OGR_GT_IsSubClassOf(wkbFlatten(geometry.getGeometryType()), wkbGeometryCollection)) {
+            for (const auto* part : *geometry.toGeometryCollection()) {
+                add_parts(collection, *part);
+            }
+        } else if (geometry.getDimension() == collection.getDimension() && !geometry.IsEmpty()) {
+            collection.addGeometry(&geometry);
+        }
+    }
+
+    std::unique_ptr<OGRGeometry> clip(const OGRGeometry& geometry, std::size_t layer, uint32_t x, uint32_t y) const {
+        const double min_lon = tile_x_to_lon(x);
+        const double max_lon = tile_x_to_lon(x + 1);
+        const double min_lat = tile_y_to_lat(y + 1);
+        const double max_lat = tile_y_to_lat(y);
+
+        OGRLinearRing ring;
+        ring.addPoint(min_lon, min_lat);
+        ring.addPoint(max_lon, min_lat);
+        ring.addPoint(max_lon, max_lat);
+        ring.addPoint(min_lon, max_lat);
+        ring.addPoint(min_lon, min_lat);
+        OGRPolygon box;
+        box.addRing(&ring);
+
+        std::unique_ptr<OGRGeometry> clipped{geometry.Intersection(&box)};
+        if (!clipped) {
+            // No GEOS support in GDAL, write geometry unclipped.
+            clipped.reset(geometry.clone());
+        }
+        if (clipped->IsEmpty()) {
+            return nullptr;
+        }
+
+        // Only lines and polygons are clipped, so this is a collection.
+        const auto type = tile_geometry_type(layer);
+        assert(OGR_GT_IsSubClassOf(type, wkbGeometryCollection));
+        std::unique_ptr<OGRGeometry> result{OGRGeometryFactory::createGeometry(type)};
+        add_parts(*result->toGeometryCollection(), *clipped);
+        if (result->IsEmpty()) {
+            return nullptr; // only a degenerate part was left
+        }
+        return result;
+    }
+
+    std::string tile_directory(uint32_t x) const {
+        return m_directory + "/" + std::to_string(m_zoom) + "/" + std::to_string(x);
+    }
+
+    tile_dataset& open_tile(uint64_t key) {
+        auto it = m_open_tiles.find(key);
+        if (it != m_open_tiles.end()) {
+            it->second.last_use = ++m_use_counter;
+            return it->second;
+        }
+
+        if (m_open_tiles.size() >= max_open_tiles) {
+            const auto lru = std::min_element(m_open_tiles.begin(), m_open_tiles.end(), [](const auto& a, const auto& b) {
+                return a.second.last_use < b.second.last_use;
+            });
+            m_open_tiles.erase(lru);
+        }
+
+        const auto x = static_cast<uint32_t>(key >> 32U);
+        const auto y = static_cast<uint32_t>(key & 0xffffffffU);
+        const std::string filename{tile_directory(x) + "/" + std::to_string(y) + "." + m_extension};
+
+        tile_dataset tile;
+        tile.last_use = ++m_use_counter;
+
+        if (m_created_tiles.count(key)) {
+            tile.dataset.reset(static_cast<GDALDataset*>(GDALOpenEx(filename.c_str(), GDAL_OF_VECTOR | GDAL_OF_UPDATE, nullptr, nullptr, nullptr)));
+            if (!tile.dataset) {
+                throw std::runtime_error{"Can not open tile dataset '" + filename + "'"};
+            }
+            for (const auto* layer : m_layers) {
+                tile.layers.push_back(tile.dataset->GetLayerByName(layer->get().GetName()));
+                if (!tile.layers.back()) {
+                    throw std::runtime_error{"Missing layer in tile dataset '" + filename + "'"};
+                }
+            }
+        } else {
+            std::filesystem::create_directories(tile_directory(x));
+
+            GDALDriver* driver = GetGDALDriverManager()->GetDriverByName(m_format.c_str());
+            if (!driver) {
+                throw std::runtime_error{"Unknown output format '" + m_format + "'"};
+            }
+
+            std::vector<const char*> options;
+            for (const auto& option : m_dataset_options) {
+                options.push_back(option.c_str());
+            }
+            options.push_back(nullptr);
+
+            tile.dataset.reset(driver->Create(filename.c_str(), 0, 0, 0, GDT_Unknown, const_cast<char**>(options.data())));
+            if (!tile.dataset) {
+                throw std::runtime_error{"Can not create tile dataset '" + filename + "'"};
+            }
+
+            if (m_format == "SQLite") {
+                tile.dataset->ReleaseResultSet(tile.dataset->ExecuteSQL("PRAGMA journal_mode = OFF;", nullptr, nullptr));
+            }
+
+            const char* const layer_options[] = {"SPATIAL_INDEX=NO", nullptr};
+            for (std::size_t i = 0; i < m_layers.size(); ++i) {
+                OGRLayer& source = m_layers[i]->get();
+                OGRLayer* layer = tile.dataset->CreateLayer(source.GetName(), source.GetSpatialRef(), tile_geometry_type(i), const_cast<char**>(layer_options));
+                if (!layer) {
+                    throw std::runtime_error{"Can not create layer in tile dataset '" + filename + "'"};
+                }
+                OGRFeatureDefn* defn = source.GetLayerDefn();
+                for (int f = 0; f < defn->GetFieldCount(); ++f) {
+                    layer->CreateField(defn->GetFieldDefn(f));
+                }
+                tile.layers.push_back(layer);
+            }
+
+            m_created_tiles.insert(key);
+        }
+
+        return m_open_tiles[key] = std::move(tile);
+    }
+
+public:
+
+    TiledOutput(std::string directory, std::string format, std::vector<std::string> dataset_options, uint32_t zoom, bool clip) :
+        m_directory(std::move(directory)),
+        m_format(std::move(format)),
+        m_dataset_options(std::move(dataset_options)),
+        m_zoom(zoom),
+        m_clip(clip) {
+        if (zoom > 20) {
+            throw std::runtime_error{"Zoom level for tiles must be between 0 and 20"};
+        }
+        GDALDriver* driver = GetGDALDriverManager()->GetDriverByName(m_format.c_str());
+        const char* extension = driver ? driver->GetMetadataItem(GDAL_DMD_EXTENSION) : nullptr;
+        m_extension = (extension && *extension) ? extension : "db";
+    }
+
+    /// Register layer, all layers must be added before the first feature.
+    std::size_t add_layer(gdalcpp::Layer& layer) {
+        m_layers.push_back(&layer);
+        return m_layers.size() - 1;
+    }
+
+    /// Add feature to all tiles it overlaps. The feature is copied.
+    void add(std::size_t layer, const OGRFeature& feature) {
+        const OGRGeometry* geometry = feature.GetGeometryRef();
+        if (!geometry || geometry->IsEmpty()) {
+            return;
+        }
+
+        OGREnvelope envelope;
+        geometry->getEnvelope(&envelope);
+
+        const uint32_t min_x = lon_to_tile_x(envelope.MinX);
+        const uint32_t max_x = lon_to_tile_x(envelope.MaxX);
+        const uint32_t min_y = lat_to_tile_y(envelope.MaxY);
+        const uint32_t max_y = lat_to_tile_y(envelope.MinY);
+
+        const bool single_tile = min_x == max_x && min_y == max_y;
+
+        if (!m_clip || single_tile) {
+            std::shared_ptr<OGRFeature> copy{feature.Clone(), feature_deleter{}};
+            if (m_clip) {
+                copy->SetGeometryDirectly(OGRGeometryFactory::forceTo(copy->StealGeometry(), tile_geometry_type(layer)));
+            }
+            m_buffered_bytes += feature_size(*copy);
+            for (uint32_t x = min_x; x <= max_x; ++x) {
+                for (uint32_t y = min_y; y <= max_y; ++y) {
+                    m_buffers[tile_key(x, y)].emplace_back(layer, copy);
+                    m_buffered_bytes += sizeof(buffer_entry);
+                }
+            }
+        } else {
+            // Copy of the fields only, the clipped geometry is added
+            // for each tile.
+            feature_ptr fields{feature.Clone()};
+            fields->SetGeometryDirectly(nullptr);
+            for (uint32_t x = min_x; x <= max_x; ++x) {
+                for (uint32_t y = min_y; y <= max_y; ++y) {
+                    auto clipped = clip(*geometry, layer, x, y);
+                    if (!clipped) {
+                        continue;
+                    }
+                    std::shared_ptr<OGRFeature> copy{fields->Clone(), feature_deleter{}};
+                    copy->SetGeometryDirectly(clipped.release());
+                    m_buffered_bytes += feature_size(*copy) + sizeof(buffer_entry);
+                    m_buffers[tile_key(x, y)].emplace_back(layer, std::move(copy));
+                }
+            }
+        }
+
+        if (m_buffered_bytes >= max_buffered_bytes) {
+            flush();
+        }
+    }
+
+    /// Write all buffered features to their tile datasets.
+    void flush() {
+        for (auto& buffer : m_buffers) {
+            auto& tile = open_tile(buffer.first);
+            tile.dataset->StartTransaction();
+            for (const auto& entry : buffer.second) {
+                OGRLayer* layer = tile.layers[entry.first];
+                feature_ptr feature{OGRFeature::CreateFeature(layer->GetLayerDefn())};
+                feature->SetFrom(entry.second.get());
+                feature->SetFID(OGRNullFID);
+                if (layer->CreateFeature(feature.get()) != OGRERR_NONE) {
+                    throw std::runtime_error{std::string{"Failed to create feature on layer '"} + layer->GetName() + "' of tile dataset"};
+                }
+            }
+            tile.dataset->CommitTransaction();
+        }
+        m_buffers.clear();
+        m_buffered_bytes = 0;
+    }
+
+    /// Flush buffers and close all tile datasets.
+    void close() {
+        flush();
+        m_open_tiles.clear();
+    }
+
+    std::size_t num_tiles_written() const noexcept {
+        return m_created_tiles.size();
+    }
+
+}; // class TiledOutput
+
+#endif // OSM_GIS_EXPORT_TILED_OUTPUT_HPP
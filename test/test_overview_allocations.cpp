@@ -0,0 +1,243 @@
+/*
+ * Checks that the handler of osm_gis_export_overview doesn't allocate
+ * memory per feature once it is warmed up: The nodes, ways, and areas of
+ * the fixture are written twice, the second time all calls to operator
+ * new are counted. Routes go through the RouteManager, which completes
+ * each route only once, so the first route is the warm up and only the
+ * handler callbacks for the later routes are counted. The output driver
+ * itself allocates for each feature it stores, so those allocations are
+ * measured separately by writing the same features into a second dataset
+ * and subtracted. (Allocations in GDAL that go through CPLMalloc() are
+ * not counted at all.)
+ *
+ * Usage: test_overview_allocations OSM-FILE
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+std::atomic<std::size_t> allocations{0};
+std::atomic<bool> counting{false};
+
+} // anonymous namespace
+
+void* operator new(std::size_t size) {
+    if (counting) {
+        ++allocations;
+    }
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc{};
+}
+
+void* operator new[](std::size_t size) {
+    return ::operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t /*size*/) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t /*size*/) noexcept {
+    std::free(ptr);
+}
+
+#include "overview_handler.hpp"
+#include "route_manager.hpp"
+#include "simple_ring.hpp"
+
+#include <gdalcpp.hpp>
+
+#include <osmium/area/assembler.hpp>
+#include <osmium/area/multipolygon_manager.hpp>
+#include <osmium/geom/ogr.hpp>
+#include <osmium/handler/node_locations_for_ways.hpp>
+#include <osmium/index/map/flex_mem.hpp> // IWYU pragma: keep
+#include <osmium/io/any_input.hpp> // IWYU pragma: keep
+#include <osmium/memory/buffer.hpp>
+#include <osmium/visitor.hpp>
+
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+using index_type = osmium::index::map::FlexMem<osmium::unsigned_object_id_type, osmium::Location>;
+using location_handler_type = osmium::handler::NodeLocationsForWays<index_type>;
+
+namespace {
+
+struct feature_deleter {
+    void operator()(OGRFeature* feature) const noexcept {
+        OGRFeature::DestroyFeature(feature);
+    }
+};
+
+struct dataset_closer {
+    void operator()(GDALDataset* dataset) const noexcept {
+        GDALClose(dataset);
+    }
+};
+
+template <typename THandler>
+void write_all(THandler& handler, const osmium::memory::Buffer& data, const osmium::memory::Buffer& areas) {
+    osmium::apply(data, handler);
+    osmium::apply(areas, handler);
+}
+
+/**
+ * Write the second half of the features in the layer to a new layer
+ * with the same schema that already contains the first half. Returns
+ * the number of allocations done while writing.
+ */
+std::size_t driver_allocations(GDALDataset& reference, OGRLayer& layer) {
+    OGRFeatureDefn* defn = layer.GetLayerDefn();
+    OGRLayer* copy = reference.CreateLayer(layer.GetName(), layer.GetSpatialRef(), defn->GetGeomType(), nullptr);
+    if (!copy) {
+        throw std::runtime_error{"Can not create reference layer"};
+    }
+    for (int i = 0; i < defn->GetFieldCount(); ++i) {
+        copy->CreateField(defn->GetFieldDefn(i));
+    }
+
+    std::vector<std::unique_ptr<OGRFeature, feature_deleter>> features;
+    layer.ResetReading();
+    while (OGRFeature* feature = layer.GetNextFeature()) {
+        std::unique_ptr<OGRFeature, feature_deleter> original{feature};
+        features.emplace_back(OGRFeature::CreateFeature(copy->GetLayerDefn()));
+        features.back()->SetFrom(original.get());
+        features.back()->SetFID(OGRNullFID);
+    }
+
+    const std::size_t half = features.size() / 2;
+    for (std::size_t i = 0; i < half; ++i) {
+        copy->CreateFeature(features[i].get());
+    }
+
+    allocations = 0;
+    counting = true;
+    for (std::size_t i = half; i < features.size(); ++i) {
+        copy->CreateFeature(features[i].get());
+    }
+    counting = false;
+
+    return allocations;
+}
+
+bool check_layer(GDALDataset& dataset, const char* name, GIntBig expected) {
+    OGRLayer* layer = dataset.GetLayerByName(name);
+    const GIntBig count = layer ? layer->GetFeatureCount() : -1;
+    if (count != 2 * expected) {
+        std::cerr << "Layer '" << name << "' has " << count << " features, expected " << 2 * expected << '\n';
+        return false;
+    }
+    return true;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " OSM-FILE\n";
+        return 2;
+    }
+
+    try {
+        GDALAllRegister();
+        const char* memory_driver = GetGDALDriverManager()->GetDriverByName("Memory") ? "Memory" : "MEM";
+
+        // Set up everything that isn't part of the handler: node
+        // locations, the areas from the multipolygon relations, and the
+        // routes, which are kept incomplete until their member ways are
+        // seen in the route pass below.
+        const osmium::io::File input_file{argv[1]};
+        osmium::memory::Buffer data = osmium::io::read_file(input_file);
+
+        osmium::area::Assembler::config_type assembler_config;
+        osmium::area::Assembler::config_type mp_assembler_config{assembler_config};
+        mp_assembler_config.create_way_polygons = false;
+        osmium::area::MultipolygonManager<osmium::area::Assembler> mp_manager{mp_assembler_config};
+        AreaRelationMembers area_members;
+
+        osmium::geom::OGRFactory<> factory{};
+        RouteManager<decltype(factory)::projection_type> route_manager;
+        osmium::relations::read_relations(input_file, mp_manager, area_members, route_manager);
+
+        index_type index_pos;
+        location_handler_type location_handler{index_pos};
+        osmium::memory::Buffer areas{1024, osmium::memory::Buffer::auto_grow::yes};
+        osmium::apply(data, location_handler, mp_manager.handler([&areas](const osmium::memory::Buffer& area_buffer) {
+            areas.add_buffer(area_buffer);
+            areas.commit();
+        }));
+
+        config cfg;
+        cfg.add_metadata = true;
+        cfg.add_routes = true;
+
+        gdalcpp::Dataset dataset{memory_driver, "", gdalcpp::SRS{factory.proj_string()}};
+        MyOGRHandler<decltype(factory)::projection_type> handler(dataset, factory, cfg, assembler_config, area_members);
+
+        write_all(handler, data, areas); // warm up
+
+        allocations = 0;
+        counting = true;
+        write_all(handler, data, areas);
+        counting = false;
+
+        // Only the callback is counted, not the bookkeeping of the
+        // RouteManager, which stores each way geometry it needs once.
+        std::size_t completed_routes = 0;
+        osmium::apply(data, route_manager.handler([&](const osmium::Relation& relation, const decltype(route_manager)& routes) {
+            counting = completed_routes++ > 0;
+            handler.route(relation, routes);
+            counting = false;
+        }));
+        const std::size_t handler_allocations = allocations;
+
+        handler.finish();
+
+        // The closed ways 14 and 16 are members of multipolygon and
+        // boundary relations, so they must not get areas of their own.
+        // Of the two routes one was written while warming up and one
+        // while counting.
+        bool ok = check_layer(dataset.get(), "points", 1) &&
+                  check_layer(dataset.get(), "lines", 8) &&
+                  check_layer(dataset.get(), "areas", 4) &&
+                  check_layer(dataset.get(), "routes", 1);
+
+        GDALDriver* driver = GetGDALDriverManager()->GetDriverByName(memory_driver);
+        std::unique_ptr<GDALDataset, dataset_closer> reference{driver->Create("", 0, 0, 0, GDT_Unknown, nullptr)};
+        std::size_t expected_allocations = 0;
+        for (const char* name : {"points", "lines", "areas", "routes"}) {
+            expected_allocations += driver_allocations(*reference, *dataset.get().GetLayerByName(name));
+        }
+
+        std::cout << "Allocations while writing: " << handler_allocations
+                  << " (" << expected_allocations << " in the output driver)\n";
+        if (handler_allocations != expected_allocations) {
+            std::cerr << "Handler allocated " << (static_cast<long long>(handler_allocations) - static_cast<long long>(expected_allocations))
+                      << " times in steady state, expected none\n";
+            ok = false;
+        }
+
+        return ok ? 0 : 1;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
+    }
+}